@@ -0,0 +1,123 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Bump allocator for the script preprocessor.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "pp_arena.h"
+
+#if PP_TEST
+#define tracemalloc(name, size)		malloc(size)
+#define tracefree(ptr)				free(ptr)
+#else
+#include "tracemalloc.h"
+#endif
+
+#define ARENA_CHUNK_SIZE	(32 * 1024) // not counting the header
+#define ARENA_ALIGNMENT		8
+
+struct pp_arena_chunk {
+	pp_arena_chunk* previous;
+	// the memory handed out follows, aligned to ARENA_ALIGNMENT
+};
+
+#define CHUNK_HEADER_SIZE	((sizeof(pp_arena_chunk) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+/**
+ * Initializes an empty arena.  Nothing is allocated until memory is requested.
+ */
+void pp_arena_init(pp_arena* self)
+{
+	self->chunks = NULL;
+	self->next = NULL;
+	self->end = NULL;
+}
+
+/**
+ * Frees everything allocated from an arena and leaves it empty.
+ */
+void pp_arena_clear(pp_arena* self)
+{
+	while(self->chunks)
+	{
+		pp_arena_chunk* previous = self->chunks->previous;
+		tracefree(self->chunks);
+		self->chunks = previous;
+	}
+	pp_arena_init(self);
+}
+
+/**
+ * Allocates a chunk of memory and links it into an arena's list.
+ * @return the memory after the chunk's header, or NULL
+ */
+static char* new_chunk(pp_arena* self, size_t size, bool current)
+{
+	pp_arena_chunk* chunk = tracemalloc("pp_arena", CHUNK_HEADER_SIZE + size);
+
+	if(chunk == NULL) return NULL;
+	if(current || self->chunks == NULL)
+	{
+		chunk->previous = self->chunks;
+		self->chunks = chunk;
+	}
+	else
+	{
+		// keep allocating from the current chunk
+		chunk->previous = self->chunks->previous;
+		self->chunks->previous = chunk;
+	}
+	return (char*)chunk + CHUNK_HEADER_SIZE;
+}
+
+/**
+ * Allocates memory from an arena, aligned for any of the preprocessor's types.
+ * @return the memory, or NULL if a new chunk couldn't be allocated
+ */
+void* pp_arena_alloc(pp_arena* self, size_t size)
+{
+	char* memory;
+
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	if((size_t)(self->end - self->next) >= size)
+	{
+		memory = self->next;
+		self->next += size;
+		return memory;
+	}
+
+	// big allocations get a chunk of their own, so that the rest of the 
+	// current chunk isn't wasted
+	if(size > ARENA_CHUNK_SIZE / 4)
+		return new_chunk(self, size, false);
+
+	if((memory = new_chunk(self, ARENA_CHUNK_SIZE, true)) == NULL)
+		return NULL;
+	self->next = memory + size;
+	self->end = memory + ARENA_CHUNK_SIZE;
+	return memory;
+}
+
+/**
+ * Copies text into an arena as a NUL-terminated string.
+ * @return the copy, or NULL if a new chunk couldn't be allocated
+ */
+char* pp_arena_strndup(pp_arena* self, const char* text, size_t length)
+{
+	char* copy = pp_arena_alloc(self, length + 1);
+
+	if(copy == NULL) return NULL;
+	memcpy(copy, text, length);
+	copy[length] = '\0';
+	return copy;
+}
+
@@ -0,0 +1,35 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Bump allocator for the script preprocessor.  Memory is handed out from
+ * large chunks by moving a pointer, so an allocation costs a few instructions
+ * and no per-allocation bookkeeping.  Nothing is freed on its own; everything
+ * allocated from an arena is freed at once when it's cleared.
+ */
+
+#ifndef PP_ARENA_H
+#define PP_ARENA_H
+
+#include <stddef.h>
+
+typedef struct pp_arena_chunk pp_arena_chunk;
+
+typedef struct pp_arena {
+	pp_arena_chunk* chunks; // the newest chunk, which is allocated from
+	char* next;
+	char* end;
+} pp_arena;
+
+void pp_arena_init(pp_arena* self);
+void pp_arena_clear(pp_arena* self);
+void* pp_arena_alloc(pp_arena* self, size_t size);
+char* pp_arena_strndup(pp_arena* self, const char* text, size_t length);
+
+#endif
+
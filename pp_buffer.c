@@ -0,0 +1,118 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Resizable byte buffer and rope used by the script preprocessor for its output.
+ */
+
+#include <stdlib.h>
+#include "pp_buffer.h"
+
+#if PP_TEST
+#define tracerealloc(ptr, size, os)	realloc(ptr, size)
+#define tracefree(ptr)				free(ptr)
+#else
+#include "tracemalloc.h"
+#endif
+
+#define MIN_BUFFER_SIZE	(16 * 1024)
+#define MIN_ROPE_SPANS	256
+
+/**
+ * Initializes an empty buffer.  Nothing is allocated until text is added.
+ */
+void pp_buffer_init(pp_buffer* self)
+{
+	self->data = NULL;
+	self->length = 0;
+	self->capacity = 0;
+}
+
+/**
+ * Frees the contents of a buffer and leaves it empty.
+ */
+void pp_buffer_clear(pp_buffer* self)
+{
+	if(self->data) tracefree(self->data);
+	pp_buffer_init(self);
+}
+
+/**
+ * Makes sure a buffer has room for text of the given length plus its NUL
+ * terminator.  The capacity is at least doubled when the buffer grows, so
+ * repeated appends are amortized O(1) per byte.
+ * @param length the total length of text the buffer should be able to hold
+ * @return false if the memory couldn't be allocated; the buffer is unchanged
+ */
+bool pp_buffer_reserve(pp_buffer* self, size_t length)
+{
+	size_t capacity = self->capacity ? self->capacity : MIN_BUFFER_SIZE;
+	char* data;
+
+	if(length < self->capacity) return true;
+	while(capacity <= length) capacity *= 2;
+
+	data = tracerealloc(self->data, capacity, self->capacity);
+	if(data == NULL) return false;
+	if(self->data == NULL) data[0] = '\0';
+
+	self->data = data;
+	self->capacity = capacity;
+	return true;
+}
+
+/**
+ * Appends the text of every span of a rope to a buffer.
+ * @return false if the buffer couldn't be enlarged
+ */
+bool pp_buffer_append_rope(pp_buffer* self, const pp_rope* rope)
+{
+	int i;
+
+	if(!pp_buffer_reserve(self, self->length + rope->length)) return false;
+	for(i=0; i<rope->count; i++)
+		pp_buffer_append(self, rope->spans[i].text, rope->spans[i].length);
+	return true;
+}
+
+/**
+ * Initializes an empty rope.  Nothing is allocated until a span is added.
+ */
+void pp_rope_init(pp_rope* self)
+{
+	self->spans = NULL;
+	self->count = 0;
+	self->capacity = 0;
+	self->length = 0;
+}
+
+/**
+ * Frees the spans of a rope and leaves it empty.  The text they refer to is 
+ * not touched.
+ */
+void pp_rope_clear(pp_rope* self)
+{
+	if(self->spans) tracefree(self->spans);
+	pp_rope_init(self);
+}
+
+/**
+ * Doubles the number of spans a rope has room for.
+ * @return false if the memory couldn't be allocated; the rope is unchanged
+ */
+bool pp_rope_grow(pp_rope* self)
+{
+	int capacity = self->capacity ? self->capacity * 2 : MIN_ROPE_SPANS;
+	pp_span* spans = tracerealloc(self->spans, capacity * sizeof(pp_span), self->capacity * sizeof(pp_span));
+
+	if(spans == NULL) return false;
+	self->spans = spans;
+	self->capacity = capacity;
+	return true;
+}
+
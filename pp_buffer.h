@@ -0,0 +1,95 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Output storage for the script preprocessor.
+ * 
+ * pp_buffer is a resizable byte buffer.  Text is appended at the tail, and the 
+ * buffer grows geometrically, so appending n bytes in total costs O(n) no 
+ * matter how small the pieces are.  The contents are always NUL-terminated so 
+ * that they can be used as a C string.
+ * 
+ * pp_rope is a sequence of spans of text that lives somewhere else, such as 
+ * the source code being preprocessed.  Appending a span that starts where the 
+ * last one ends just lengthens the last one, so a run of tokens copied from 
+ * the source becomes a single span and nothing is copied until the rope is 
+ * flattened into a pp_buffer (if it ever is).  The text a rope refers to must 
+ * outlive it.
+ */
+
+#ifndef PP_BUFFER_H
+#define PP_BUFFER_H
+
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+
+typedef struct pp_buffer {
+	char* data;
+	size_t length;   // not counting the NUL terminator
+	size_t capacity; // including the NUL terminator
+} pp_buffer;
+
+typedef struct pp_span {
+	const char* text;
+	size_t length;
+} pp_span;
+
+typedef struct pp_rope {
+	pp_span* spans;
+	int count;
+	int capacity;
+	size_t length;   // total length of all spans
+} pp_rope;
+
+void pp_buffer_init(pp_buffer* self);
+void pp_buffer_clear(pp_buffer* self);
+bool pp_buffer_reserve(pp_buffer* self, size_t length);
+bool pp_buffer_append_rope(pp_buffer* self, const pp_rope* rope);
+void pp_rope_init(pp_rope* self);
+void pp_rope_clear(pp_rope* self);
+bool pp_rope_grow(pp_rope* self);
+
+/**
+ * Appends bytes to the end of a buffer.
+ * @return false if the buffer couldn't be enlarged; its contents are unchanged
+ */
+static __inline__ bool pp_buffer_append(pp_buffer* self, const char* text, size_t length)
+{
+	if(self->length + length >= self->capacity && !pp_buffer_reserve(self, self->length + length))
+		return false;
+
+	memcpy(self->data + self->length, text, length);
+	self->length += length;
+	self->data[self->length] = '\0';
+	return true;
+}
+
+/**
+ * Appends a span of text to the end of a rope, merging it into the last span 
+ * if the two are adjacent.
+ * @return false if the rope couldn't be enlarged; its contents are unchanged
+ */
+static __inline__ bool pp_rope_append(pp_rope* self, const char* text, size_t length)
+{
+	if(self->count && self->spans[self->count-1].text + self->spans[self->count-1].length == text)
+		self->spans[self->count-1].length += length;
+	else
+	{
+		if(self->count == self->capacity && !pp_rope_grow(self))
+			return false;
+		self->spans[self->count].text = text;
+		self->spans[self->count].length = length;
+		self->count++;
+	}
+	self->length += length;
+	return true;
+}
+
+#endif
+
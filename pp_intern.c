@@ -0,0 +1,160 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Identifier interning for the script preprocessor.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pp_intern.h"
+
+#if PP_TEST
+#define tracecalloc(name, size)		calloc(1, size)
+#define tracerealloc(ptr, size, os)	realloc(ptr, size)
+#define tracefree(ptr)				free(ptr)
+#else
+#include "tracemalloc.h"
+#endif
+
+#define MIN_INTERN_SLOTS	1024
+
+/**
+ * Hashes a string (FNV-1a).
+ */
+static __inline__ uint32_t hash_string(const char* text, int length)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for(i=0; i<length; i++)
+		hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+	return hash;
+}
+
+/**
+ * Finds the slot that holds a string, or the empty slot where it would go.
+ * \pre the slots have been allocated
+ */
+static pp_intern_slot* find_slot(const pp_intern_table* self, const char* text, uint32_t length, uint32_t hash)
+{
+	uint32_t mask = self->slotCapacity - 1;
+	uint32_t i;
+
+	for(i = hash & mask; self->slots[i].atom; i = (i + 1) & mask)
+	{
+		const pp_intern_slot* slot = &self->slots[i];
+		if(slot->hash == hash && self->atoms[slot->atom].length == length &&
+		   memcmp(self->names.data + self->atoms[slot->atom].offset, text, length) == 0)
+			break;
+	}
+	return &self->slots[i];
+}
+
+/**
+ * Doubles the size of the hash table.
+ * @return false if the memory couldn't be allocated; the table is unchanged
+ */
+static bool grow_slots(pp_intern_table* self)
+{
+	uint32_t capacity = self->slotCapacity ? self->slotCapacity * 2 : MIN_INTERN_SLOTS;
+	pp_intern_slot* slots = tracecalloc("pp_intern slots", capacity * sizeof(pp_intern_slot));
+	uint32_t mask = capacity - 1, i, j;
+
+	if(slots == NULL) return false;
+	for(i=0; i<self->slotCapacity; i++)
+	{
+		if(self->slots[i].atom == 0) continue;
+		for(j = self->slots[i].hash & mask; slots[j].atom; j = (j + 1) & mask);
+		slots[j] = self->slots[i];
+	}
+
+	if(self->slots) tracefree(self->slots);
+	self->slots = slots;
+	self->slotCapacity = capacity;
+	return true;
+}
+
+/**
+ * Initializes an empty intern table.  Nothing is allocated until a string is
+ * added.
+ */
+void pp_intern_init(pp_intern_table* self)
+{
+	pp_buffer_init(&self->names);
+	self->atoms = NULL;
+	self->count = 0;
+	self->atomCapacity = 0;
+	self->slots = NULL;
+	self->slotCapacity = 0;
+}
+
+/**
+ * Frees an intern table and leaves it empty.  Atoms handed out before this
+ * are no longer valid.
+ */
+void pp_intern_clear(pp_intern_table* self)
+{
+	pp_buffer_clear(&self->names);
+	if(self->atoms) tracefree(self->atoms);
+	if(self->slots) tracefree(self->slots);
+	pp_intern_init(self);
+}
+
+/**
+ * Returns the atom of a string, adding the string to the table if it isn't
+ * there yet.
+ * @param text the string, which doesn't need to be NUL-terminated
+ * @return the atom, or 0 if the table couldn't be enlarged
+ */
+pp_atom pp_intern(pp_intern_table* self, const char* text, int length)
+{
+	uint32_t hash = hash_string(text, length);
+	pp_intern_slot* slot;
+	pp_atom atom;
+
+	// keep the load factor at or below 3/4
+	if((self->count + 1) * 4 > self->slotCapacity * 3 && !grow_slots(self))
+		return 0;
+
+	slot = find_slot(self, text, length, hash);
+	if(slot->atom) return slot->atom;
+
+	// atom 0 is never used, so the array has room for count + 1 atoms
+	if(self->count + 1 >= self->atomCapacity)
+	{
+		uint32_t capacity = self->atomCapacity ? self->atomCapacity * 2 : MIN_INTERN_SLOTS;
+		pp_atom_info* atoms = tracerealloc(self->atoms, capacity * sizeof(pp_atom_info),
+		                                   self->atomCapacity * sizeof(pp_atom_info));
+		if(atoms == NULL) return 0;
+		self->atoms = atoms;
+		self->atomCapacity = capacity;
+	}
+
+	atom = self->count + 1;
+	self->atoms[atom].offset = self->names.length;
+	self->atoms[atom].length = length;
+	if(!pp_buffer_append(&self->names, text, length) || !pp_buffer_append(&self->names, "", 1))
+		return 0;
+
+	slot->hash = hash;
+	slot->atom = atom;
+	self->count = atom;
+	return atom;
+}
+
+/**
+ * Returns the atom of a string without adding it to the table.
+ * @return the atom, or 0 if the string has never been interned
+ */
+pp_atom pp_intern_find(const pp_intern_table* self, const char* text, int length)
+{
+	if(self->count == 0) return 0;
+	return find_slot(self, text, length, hash_string(text, length))->atom;
+}
+
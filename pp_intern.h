@@ -0,0 +1,61 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Identifier interning for the script preprocessor.  Each distinct string
+ * added to a pp_intern_table gets a small integer ID, its atom, which stays
+ * the same for as long as the table lives.  Once an identifier has been
+ * interned, comparing it with another is comparing two integers, and the atom
+ * can be used directly as an index into arrays such as the macro table.
+ */
+
+#ifndef PP_INTERN_H
+#define PP_INTERN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pp_buffer.h"
+
+// Atoms are numbered from 1; 0 means "no atom".
+typedef uint32_t pp_atom;
+
+typedef struct pp_intern_slot {
+	uint32_t hash;
+	pp_atom atom; // 0 if the slot is empty
+} pp_intern_slot;
+
+typedef struct pp_atom_info {
+	uint32_t offset; // where the name starts in the table's names buffer
+	uint32_t length;
+} pp_atom_info;
+
+typedef struct pp_intern_table {
+	pp_buffer names;       // every name, each followed by a NUL
+	pp_atom_info* atoms;   // indexed by atom
+	pp_atom count;         // the highest atom handed out
+	uint32_t atomCapacity;
+	pp_intern_slot* slots; // open-addressing hash table of atoms
+	uint32_t slotCapacity; // always a power of 2
+} pp_intern_table;
+
+void pp_intern_init(pp_intern_table* self);
+void pp_intern_clear(pp_intern_table* self);
+pp_atom pp_intern(pp_intern_table* self, const char* text, int length);
+pp_atom pp_intern_find(const pp_intern_table* self, const char* text, int length);
+
+/**
+ * @return the NUL-terminated name of an atom, which is only valid until the
+ *         next string is added to the table
+ */
+static __inline__ const char* pp_intern_name(const pp_intern_table* self, pp_atom atom)
+{
+	return self->names.data + self->atoms[atom].offset;
+}
+
+#endif
+
@@ -25,38 +25,91 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+//AVX2 is chosen at run time, so it doesn't depend on the compiler's target
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PP_SCAN_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#if PP_TEST
+#define tracerealloc(ptr, size, os)	realloc(ptr, size)
+#define tracefree(ptr)				free(ptr)
+#else
+#include "tracemalloc.h"
+#endif
 
 //MACROS
 /******************************************************************************
 *  CONSUMECHARACTER -- This macro inserts code to remove a character from the
-*  input stream and add it to the current token buffer.
+*  input stream and add it to the current token.  The current token is the
+*  text between plexer->tokOffset and plexer->offset, so this is O(1) and
+*  nothing is copied.
 ******************************************************************************/
 #define CONSUMECHARACTER \
-   plexer->theTokenSource[strlen(plexer->theTokenSource)] = *(plexer->pcurChar);\
-   plexer->theTokenSource[strlen(plexer->theTokenSource)] = '\0';\
    plexer->pcurChar++; \
-   plexer->theTextPosition.col++; \
    plexer->offset++;
 
+/******************************************************************************
+*  CHARAT(n), CURCHAR -- The character n places after the current one, or '\0'
+*  if that's past the end of the input.  The input doesn't have to be
+*  NUL-terminated, so nothing at or after plexer->pend is ever read.
+******************************************************************************/
+#define CHARAT(n) \
+   (plexer->pcurChar + (n) < plexer->pend ? plexer->pcurChar[n] : '\0')
+
+#define CURCHAR CHARAT(0)
+
+/******************************************************************************
+*  CONSUMEUNLESSEND -- Like CONSUMECHARACTER, but does nothing at the end of
+*  the input, for the places that consume a character without looking at it.
+******************************************************************************/
+#define CONSUMEUNLESSEND \
+   if (CURCHAR != '\0'){ \
+      CONSUMECHARACTER; \
+   }
+
 /******************************************************************************
 *  MAKETOKEN(x) -- This macro inserts code to create a new CToken object of
-*  type x, using the current token position, and source.
+*  type x, using the current token position, and source.  The token refers to
+*  the characters consumed since the start of the token in the input stream;
+*  nothing is copied.
 ******************************************************************************/
 #define MAKETOKEN(x) \
-   pp_token_Init(theNextToken, x, plexer->theTokenSource, plexer->theTokenPosition, \
-   plexer->tokOffset);
+   pp_token_Init(theNextToken, x, plexer->ptheSource + plexer->tokOffset, \
+   plexer->offset - plexer->tokOffset, plexer->tokOffset);
 
 /******************************************************************************
-*  SKIPCHARACTER -- Skip a character, not to plexer->theTokenSource in.
+*  MAKESYNTHTOKEN(x, s) -- Like MAKETOKEN, but for tokens whose source differs
+*  from the input stream (e.g. "\r\n", which is emitted as "\n").  The source
+*  s must be a string constant.
+******************************************************************************/
+#define MAKESYNTHTOKEN(x, s) \
+   pp_token_Init(theNextToken, x, s, sizeof(s) - 1, plexer->tokOffset);
+
+/******************************************************************************
+*  SKIPCHARACTER -- Skip a character that isn't part of any token.
 *  
 *  Original comment: 跳过一个字符，不加入到plexer->theTokenSource中。
 *  2007-1-22
 ******************************************************************************/
 #define SKIPCHARACTER \
    plexer->pcurChar++; \
-   plexer->theTextPosition.col++; \
    plexer->offset++;
 
+/******************************************************************************
+*  CONSUMETO(p), SKIPTO(p) -- Like CONSUMECHARACTER and SKIPCHARACTER, but for
+*  every character up to (not including) p.
+******************************************************************************/
+#define CONSUMETO(p) \
+   plexer->offset += (p) - plexer->pcurChar; \
+   plexer->pcurChar = (CHAR*)(p);
+
+#define SKIPTO(p) CONSUMETO(p)
+
 /******************************************************************************
 *  CONSUMEESCAPE -- Read the next escape character, and modify on plexer->theTokenSource.
 *  The escape character represents the character, reference CONSUMECHARACTER macro.
@@ -75,34 +128,457 @@
 
 
 //Constructor
-void pp_token_Init(pp_token* ptoken, PP_TOKEN_TYPE theType, LPCSTR theSource, TEXTPOS theTextPosition, ULONG charOffset)
+void pp_token_Init(pp_token* ptoken, PP_TOKEN_TYPE theType, LPCSTR theSource, int theLength, ULONG charOffset)
 {
     ptoken->theType = theType;
-    ptoken->theTextPosition = theTextPosition;
+    ptoken->theSource = theSource;
+    ptoken->theLength = theLength;
     ptoken->charOffset = charOffset;
-    strcpy(ptoken->theSource, theSource );
+    ptoken->theAtom = 0;
+}
+
+/**
+ * Copies the source of a token into a buffer as a NUL-terminated string, 
+ * truncating it if it doesn't fit.  Only needed when a token has to outlive 
+ * the buffer it refers to or be passed where a C string is expected.
+ * @return the number of characters copied, not counting the NUL
+ */
+int pp_token_CopySource(const pp_token* ptoken, CHAR* buf, int bufsize)
+{
+    int length = ptoken->theLength < bufsize ? ptoken->theLength : bufsize - 1;
+    memcpy(buf, ptoken->theSource, length);
+    buf[length] = '\0';
+    return length;
+}
+
+/**
+ * @return nonzero if the source of the token is exactly the given string
+ */
+int pp_token_Equals(const pp_token* ptoken, LPCSTR str)
+{
+    return strncmp(ptoken->theSource, str, ptoken->theLength) == 0 && str[ptoken->theLength] == '\0';
 }
 
 
 void pp_lexer_Init(pp_lexer* plexer, LPCSTR theSource, TEXTPOS theStartingPosition)
+{
+     pp_lexer_InitLength(plexer, theSource, strlen(theSource), theStartingPosition);
+}
+
+/******************************************************************************
+*  InitLength -- Like pp_lexer_Init, but for input that isn't NUL-terminated,
+*  such as a file mapped into memory.  The lexer never reads past
+*  theSource + theLength; a '\0' before that still ends the input.
+******************************************************************************/
+void pp_lexer_InitLength(pp_lexer* plexer, LPCSTR theSource, size_t theLength, TEXTPOS theStartingPosition)
 {
      plexer->ptheSource = theSource;
-     plexer->theTextPosition = theStartingPosition;
+     plexer->pend = theSource + theLength;
+     plexer->theStartingPosition = theStartingPosition;
      plexer->pcurChar = (CHAR*)plexer->ptheSource;
      plexer->offset = 0;
      plexer->tokOffset = 0;
+     plexer->flags = 0;
+     plexer->atoms = NULL;
+     plexer->lineStarts = NULL;
+     plexer->lineCount = 0;
+     plexer->lastLine = 0;
      /*pl = plexer;*/
 }
 
 void pp_lexer_Clear(pp_lexer* plexer)
 {
+    if (plexer->lineStarts) tracefree(plexer->lineStarts);
     memset(plexer, 0, sizeof(pp_lexer));
 }
 
+/******************************************************************************
+*  IndexLines -- Records the offset at which each line of the input starts.
+*  Line breaks are found with pp_lexer_Scan, so this is about as fast as a
+*  memchr over the input.
+******************************************************************************/
+static HRESULT pp_lexer_IndexLines(pp_lexer* plexer)
+{
+   LPCSTR p = plexer->ptheSource;
+   int capacity = 64;
+   uint32_t* lineStarts = tracerealloc(NULL, capacity * sizeof(uint32_t), 0);
+
+   if (!lineStarts) return E_FAIL;
+   lineStarts[0] = 0;
+   plexer->lineCount = 1;
+
+   for(;;){
+      p = pp_lexer_Scan(p, plexer->pend, PP_SCAN_LINE_COMMENT);
+      if (p == plexer->pend || *p == '\0')
+         break;
+      if (p[0] == '\r' && p + 1 < plexer->pend && p[1] == '\n')
+         p++;
+      p++;
+
+      if (plexer->lineCount == capacity){
+         uint32_t* grown = tracerealloc(lineStarts, capacity * 2 * sizeof(uint32_t), capacity * sizeof(uint32_t));
+         if (!grown){
+            tracefree(lineStarts);
+            plexer->lineCount = 0;
+            return E_FAIL;
+         }
+         lineStarts = grown;
+         capacity *= 2;
+      }
+      lineStarts[plexer->lineCount++] = p - plexer->ptheSource;
+   }
+
+   plexer->lineStarts = lineStarts;
+   return S_OK;
+}
+
+/******************************************************************************
+*  FindLine -- Returns the index of the line containing an offset.  Offsets
+*  are usually looked up in increasing order, so the search starts by walking
+*  forward from the line found last time and only falls back to a binary
+*  search if that takes more than a few steps.  The line index must be built.
+******************************************************************************/
+static int pp_lexer_FindLine(pp_lexer* plexer, ULONG offset)
+{
+   int low = plexer->lastLine, high = plexer->lineCount - 1, line, steps;
+
+   if (plexer->lineStarts[low] <= offset){
+      for (steps = 0; steps < 4; steps++){
+         if (low == high || plexer->lineStarts[low + 1] > offset)
+            return plexer->lastLine = low;
+         low++;
+      }
+   }
+   else
+      low = 0;
+
+   //find the last line that starts at or before the offset
+   while (low < high){
+      line = (low + high + 1) / 2;
+      if (plexer->lineStarts[line] <= offset)
+         low = line;
+      else
+         high = line - 1;
+   }
+   return plexer->lastLine = low;
+}
+
+/******************************************************************************
+*  GetPosition -- The lexer doesn't keep track of rows and columns as it goes,
+*  since they're only needed for the odd diagnostic.  Instead, the first call
+*  to this method records where each line of the input starts, and every call
+*  finds the line containing the offset with a binary search.  Like the lexer,
+*  it treats "\n", "\r\n", a lone "\r" and "\f" as line breaks and counts a
+*  tab as TABSIZE columns.
+*  Parameters: offset -- a character offset into the input, such as a token's
+*                        charOffset
+*              pposition -- receives the row and column of that character
+*  Returns: S_OK
+*           E_FAIL if the line index can't be allocated
+******************************************************************************/
+HRESULT pp_lexer_GetPosition(pp_lexer* plexer, ULONG offset, TEXTPOS* pposition)
+{
+   int low;
+   LPCSTR p;
+
+   if (!plexer->lineStarts && FAILED(pp_lexer_IndexLines(plexer)))
+      return E_FAIL;
+
+   low = pp_lexer_FindLine(plexer, offset);
+   pposition->row = plexer->theStartingPosition.row + low;
+   pposition->col = low ? 0 : plexer->theStartingPosition.col;
+   for (p = plexer->ptheSource + plexer->lineStarts[low]; p < plexer->ptheSource + offset; p++)
+      pposition->col += (*p == '\t') ? TABSIZE : 1;
+
+   return S_OK;
+}
+
+/******************************************************************************
+*  GetLine -- Like GetPosition, but only works out the row, which is all that
+*  most callers need.  It's cheap enough to call for every token.
+*  Returns: the row containing the offset, or the starting row if the line
+*           index can't be allocated
+******************************************************************************/
+int pp_lexer_GetLine(pp_lexer* plexer, ULONG offset)
+{
+   if (!plexer->lineStarts && FAILED(pp_lexer_IndexLines(plexer)))
+      return plexer->theStartingPosition.row;
+   return plexer->theStartingPosition.row + pp_lexer_FindLine(plexer, offset);
+}
+
+/******************************************************************************
+*  Character classes -- The start state of the FSA only needs to know which
+*  kind of token a character can begin, so every byte is mapped to a class
+*  once here instead of being compared against each candidate in turn.
+*  Characters that aren't listed map to CC_OTHER and become error tokens.
+******************************************************************************/
+typedef enum PP_CHAR_CLASS {
+   CC_OTHER = 0, CC_END, CC_NEWLINE, CC_CARRIAGE_RETURN, CC_TAB, CC_SPACE,
+   CC_ALPHA, CC_DIGIT, CC_QUOTE, CC_APOSTROPHE, CC_SLASH, CC_SYMBOL
+} PP_CHAR_CLASS;
+
+static const unsigned char charClass[256] = {
+   ['\0'] = CC_END,
+   ['\n'] = CC_NEWLINE, ['\f'] = CC_NEWLINE, ['\r'] = CC_CARRIAGE_RETURN,
+   ['\t'] = CC_TAB, [' '] = CC_SPACE,
+   ['a' ... 'z'] = CC_ALPHA, ['A' ... 'Z'] = CC_ALPHA, ['_'] = CC_ALPHA,
+   ['0' ... '9'] = CC_DIGIT,
+   ['"'] = CC_QUOTE, ['\''] = CC_APOSTROPHE, ['/'] = CC_SLASH,
+   ['>'] = CC_SYMBOL, ['<'] = CC_SYMBOL, ['+'] = CC_SYMBOL, ['-'] = CC_SYMBOL,
+   ['*'] = CC_SYMBOL, ['%'] = CC_SYMBOL, ['&'] = CC_SYMBOL, ['^'] = CC_SYMBOL,
+   ['|'] = CC_SYMBOL, ['='] = CC_SYMBOL, ['!'] = CC_SYMBOL, [';'] = CC_SYMBOL,
+   ['{'] = CC_SYMBOL, ['}'] = CC_SYMBOL, [','] = CC_SYMBOL, [':'] = CC_SYMBOL,
+   ['('] = CC_SYMBOL, [')'] = CC_SYMBOL, ['['] = CC_SYMBOL, [']'] = CC_SYMBOL,
+   ['.'] = CC_SYMBOL, ['~'] = CC_SYMBOL, ['?'] = CC_SYMBOL, ['#'] = CC_SYMBOL,
+};
+
+#define CHARCLASS(c) (charClass[(unsigned char)(c)])
+#define ISIDENTCHAR(c) (CHARCLASS(c) == CC_ALPHA || CHARCLASS(c) == CC_DIGIT)
+#define ISDIGIT(c) (CHARCLASS(c) == CC_DIGIT)
+
+/******************************************************************************
+*  Symbol states -- Symbols are recognized by a small DFA.  Each state is the
+*  longest symbol read so far; symbolStart gives the state for the first
+*  character and symbolTransition the state after each following character,
+*  or SS_NONE if the symbol can't be extended.  Since every state accepts,
+*  following transitions until SS_NONE gives maximal munch without backtracking.
+******************************************************************************/
+typedef enum SYMBOL_STATE {
+   SS_NONE = 0,
+   SS_GT, SS_RIGHT_OP, SS_GE_OP, SS_RIGHT_ASSIGN,
+   SS_LT, SS_LEFT_OP, SS_LE_OP, SS_LEFT_ASSIGN,
+   SS_ADD, SS_INC_OP, SS_ADD_ASSIGN,
+   SS_SUB, SS_DEC_OP, SS_SUB_ASSIGN,
+   SS_MUL, SS_MUL_ASSIGN, SS_COMMENT_STAR_END,
+   SS_DIV, SS_DIV_ASSIGN,
+   SS_MOD, SS_MOD_ASSIGN,
+   SS_BITWISE_AND, SS_AND_OP, SS_AND_ASSIGN,
+   SS_XOR, SS_XOR_ASSIGN,
+   SS_BITWISE_OR, SS_OR_OP, SS_OR_ASSIGN,
+   SS_ASSIGN, SS_EQ_OP,
+   SS_BOOLEAN_NOT, SS_NE_OP,
+   SS_SEMICOLON, SS_LCURLY, SS_RCURLY, SS_COMMA, SS_COLON, SS_LPAREN, SS_RPAREN,
+   SS_LBRACKET, SS_RBRACKET, SS_FIELD, SS_BITWISE_NOT, SS_CONDITIONAL, SS_DIRECTIVE,
+   SS_COUNT
+} SYMBOL_STATE;
+
+//classes of the characters that can continue a symbol
+typedef enum SYMBOL_CLASS {
+   SC_OTHER = 0, SC_ASSIGN, SC_GT, SC_LT, SC_ADD, SC_SUB, SC_MUL, SC_DIV, SC_AND, SC_OR,
+   SC_COUNT
+} SYMBOL_CLASS;
+
+static const unsigned char symbolClass[256] = {
+   ['='] = SC_ASSIGN, ['>'] = SC_GT, ['<'] = SC_LT, ['+'] = SC_ADD, ['-'] = SC_SUB,
+   ['*'] = SC_MUL, ['/'] = SC_DIV, ['&'] = SC_AND, ['|'] = SC_OR,
+};
+
+static const unsigned char symbolStart[256] = {
+   ['>'] = SS_GT, ['<'] = SS_LT, ['+'] = SS_ADD, ['-'] = SS_SUB, ['*'] = SS_MUL,
+   ['/'] = SS_DIV, ['%'] = SS_MOD, ['&'] = SS_BITWISE_AND, ['^'] = SS_XOR,
+   ['|'] = SS_BITWISE_OR, ['='] = SS_ASSIGN, ['!'] = SS_BOOLEAN_NOT,
+   [';'] = SS_SEMICOLON, ['{'] = SS_LCURLY, ['}'] = SS_RCURLY, [','] = SS_COMMA,
+   [':'] = SS_COLON, ['('] = SS_LPAREN, [')'] = SS_RPAREN, ['['] = SS_LBRACKET,
+   [']'] = SS_RBRACKET, ['.'] = SS_FIELD, ['~'] = SS_BITWISE_NOT,
+   ['?'] = SS_CONDITIONAL, ['#'] = SS_DIRECTIVE,
+};
+
+static const unsigned char symbolTransition[SS_COUNT][SC_COUNT] = {
+   [SS_GT]          = { [SC_GT] = SS_RIGHT_OP, [SC_ASSIGN] = SS_GE_OP },
+   [SS_RIGHT_OP]    = { [SC_ASSIGN] = SS_RIGHT_ASSIGN },
+   [SS_LT]          = { [SC_LT] = SS_LEFT_OP, [SC_ASSIGN] = SS_LE_OP },
+   [SS_LEFT_OP]     = { [SC_ASSIGN] = SS_LEFT_ASSIGN },
+   [SS_ADD]         = { [SC_ADD] = SS_INC_OP, [SC_ASSIGN] = SS_ADD_ASSIGN },
+   [SS_SUB]         = { [SC_SUB] = SS_DEC_OP, [SC_ASSIGN] = SS_SUB_ASSIGN },
+   [SS_MUL]         = { [SC_ASSIGN] = SS_MUL_ASSIGN, [SC_DIV] = SS_COMMENT_STAR_END },
+   [SS_DIV]         = { [SC_ASSIGN] = SS_DIV_ASSIGN },
+   [SS_MOD]         = { [SC_ASSIGN] = SS_MOD_ASSIGN },
+   [SS_BITWISE_AND] = { [SC_AND] = SS_AND_OP, [SC_ASSIGN] = SS_AND_ASSIGN },
+   [SS_XOR]         = { [SC_ASSIGN] = SS_XOR_ASSIGN },
+   [SS_BITWISE_OR]  = { [SC_OR] = SS_OR_OP, [SC_ASSIGN] = SS_OR_ASSIGN },
+   [SS_ASSIGN]      = { [SC_ASSIGN] = SS_EQ_OP },
+   [SS_BOOLEAN_NOT] = { [SC_ASSIGN] = SS_NE_OP },
+};
+
+//the token type accepted in each symbol state
+static const unsigned char symbolToken[SS_COUNT] = {
+   [SS_GT] = PP_TOKEN_GT, [SS_RIGHT_OP] = PP_TOKEN_RIGHT_OP, [SS_GE_OP] = PP_TOKEN_GE_OP,
+   [SS_RIGHT_ASSIGN] = PP_TOKEN_RIGHT_ASSIGN,
+   [SS_LT] = PP_TOKEN_LT, [SS_LEFT_OP] = PP_TOKEN_LEFT_OP, [SS_LE_OP] = PP_TOKEN_LE_OP,
+   [SS_LEFT_ASSIGN] = PP_TOKEN_LEFT_ASSIGN,
+   [SS_ADD] = PP_TOKEN_ADD, [SS_INC_OP] = PP_TOKEN_INC_OP, [SS_ADD_ASSIGN] = PP_TOKEN_ADD_ASSIGN,
+   [SS_SUB] = PP_TOKEN_SUB, [SS_DEC_OP] = PP_TOKEN_DEC_OP, [SS_SUB_ASSIGN] = PP_TOKEN_SUB_ASSIGN,
+   [SS_MUL] = PP_TOKEN_MUL, [SS_MUL_ASSIGN] = PP_TOKEN_MUL_ASSIGN,
+   [SS_COMMENT_STAR_END] = PP_TOKEN_COMMENT_STAR_END,
+   [SS_DIV] = PP_TOKEN_DIV, [SS_DIV_ASSIGN] = PP_TOKEN_DIV_ASSIGN,
+   [SS_MOD] = PP_TOKEN_MOD, [SS_MOD_ASSIGN] = PP_TOKEN_MOD_ASSIGN,
+   [SS_BITWISE_AND] = PP_TOKEN_BITWISE_AND, [SS_AND_OP] = PP_TOKEN_AND_OP,
+   [SS_AND_ASSIGN] = PP_TOKEN_AND_ASSIGN,
+   [SS_XOR] = PP_TOKEN_XOR, [SS_XOR_ASSIGN] = PP_TOKEN_XOR_ASSIGN,
+   [SS_BITWISE_OR] = PP_TOKEN_BITWISE_OR, [SS_OR_OP] = PP_TOKEN_OR_OP,
+   [SS_OR_ASSIGN] = PP_TOKEN_OR_ASSIGN,
+   [SS_ASSIGN] = PP_TOKEN_ASSIGN, [SS_EQ_OP] = PP_TOKEN_EQ_OP,
+   [SS_BOOLEAN_NOT] = PP_TOKEN_BOOLEAN_NOT, [SS_NE_OP] = PP_TOKEN_NE_OP,
+   [SS_SEMICOLON] = PP_TOKEN_SEMICOLON, [SS_LCURLY] = PP_TOKEN_LCURLY,
+   [SS_RCURLY] = PP_TOKEN_RCURLY, [SS_COMMA] = PP_TOKEN_COMMA, [SS_COLON] = PP_TOKEN_COLON,
+   [SS_LPAREN] = PP_TOKEN_LPAREN, [SS_RPAREN] = PP_TOKEN_RPAREN,
+   [SS_LBRACKET] = PP_TOKEN_LBRACKET, [SS_RBRACKET] = PP_TOKEN_RBRACKET,
+   [SS_FIELD] = PP_TOKEN_FIELD, [SS_BITWISE_NOT] = PP_TOKEN_BITWISE_NOT,
+   [SS_CONDITIONAL] = PP_TOKEN_CONDITIONAL, [SS_DIRECTIVE] = PP_TOKEN_DIRECTIVE,
+};
+
+/******************************************************************************
+*  Scanners -- Comments and string literals are mostly made up of characters
+*  the lexer doesn't care about, so instead of examining them one at a time,
+*  the lexer jumps straight to the next character that is in one of the
+*  PP_SCAN_SET sets, or to the end of the input if there isn't one.  '\0' is
+*  in every set, since it ends the stream too.  pp_lexer_ScanScalar is the
+*  portable version and the reference that the others are tested against.
+*  The SSE2 and AVX2 versions examine 16 or 32 characters at a time.  Only
+*  the first load is unaligned, and whatever is left after the last whole
+*  block is examined one at a time, so they never read outside the input.
+*  AVX2 is only used if the CPU running the lexer has it.
+******************************************************************************/
+static const unsigned char scanStop[256] = {
+   ['\0'] = PP_SCAN_LINE_COMMENT | PP_SCAN_STAR_COMMENT | PP_SCAN_STRING,
+   ['\n'] = PP_SCAN_LINE_COMMENT, ['\r'] = PP_SCAN_LINE_COMMENT, ['\f'] = PP_SCAN_LINE_COMMENT,
+   ['*'] = PP_SCAN_STAR_COMMENT,
+   ['"'] = PP_SCAN_STRING, ['\\'] = PP_SCAN_STRING,
+};
+
+//the characters of each set that the vector scanners look for besides '\0'
+static const char scanChars[PP_SCAN_STRING + 1][4] = {
+   [PP_SCAN_LINE_COMMENT] = {'\n', '\r', '\f', '\n'},
+   [PP_SCAN_STAR_COMMENT] = {'*', '*', '*', '*'},
+   [PP_SCAN_STRING] = {'"', '\\', '"', '\\'},
+};
+
+LPCSTR pp_lexer_ScanScalar(LPCSTR p, LPCSTR end, PP_SCAN_SET set)
+{
+   while (p < end && !(scanStop[(unsigned char)*p] & set))
+      p++;
+   return p;
+}
+
+#ifdef __SSE2__
+#define SSE2_HITS(chunk) (unsigned int)_mm_movemask_epi8(_mm_or_si128( \
+   _mm_or_si128(_mm_cmpeq_epi8(chunk, zero), _mm_cmpeq_epi8(chunk, v1)), \
+   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, v2), _mm_cmpeq_epi8(chunk, v3)), \
+                _mm_cmpeq_epi8(chunk, v4))))
+
+static LPCSTR pp_lexer_ScanSSE2(LPCSTR p, LPCSTR end, PP_SCAN_SET set)
+{
+   const __m128i* block;
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i v1 = _mm_set1_epi8(scanChars[set][0]), v2 = _mm_set1_epi8(scanChars[set][1]);
+   const __m128i v3 = _mm_set1_epi8(scanChars[set][2]), v4 = _mm_set1_epi8(scanChars[set][3]);
+   unsigned int mask;
+
+   //the first 16 characters are loaded unaligned, and the blocks after them
+   //start at the next 16-byte boundary
+   if (end - p < 16)
+      return pp_lexer_ScanScalar(p, end, set);
+   mask = SSE2_HITS(_mm_loadu_si128((const __m128i*)p));
+   if (mask)
+      return p + __builtin_ctz(mask);
+   block = (const __m128i*)(((uintptr_t)p + 16) & ~(uintptr_t)15);
+
+   while ((LPCSTR)(block + 1) <= end){
+      mask = SSE2_HITS(_mm_load_si128(block));
+      if (mask)
+         return (LPCSTR)block + __builtin_ctz(mask);
+      block++;
+   }
+   return pp_lexer_ScanScalar((LPCSTR)block, end, set);
+}
+#endif
+
+#ifdef PP_SCAN_HAVE_AVX2
+#define AVX2_HITS(chunk) (unsigned int)_mm256_movemask_epi8(_mm256_or_si256( \
+   _mm256_or_si256(_mm256_cmpeq_epi8(chunk, zero), _mm256_cmpeq_epi8(chunk, v1)), \
+   _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, v2), _mm256_cmpeq_epi8(chunk, v3)), \
+                   _mm256_cmpeq_epi8(chunk, v4))))
+
+__attribute__((target("avx2")))
+static LPCSTR pp_lexer_ScanAVX2(LPCSTR p, LPCSTR end, PP_SCAN_SET set)
+{
+   const __m256i* block;
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i v1 = _mm256_set1_epi8(scanChars[set][0]), v2 = _mm256_set1_epi8(scanChars[set][1]);
+   const __m256i v3 = _mm256_set1_epi8(scanChars[set][2]), v4 = _mm256_set1_epi8(scanChars[set][3]);
+   unsigned int mask;
+
+   //like pp_lexer_ScanSSE2, but 32 characters at a time
+   if (end - p < 32)
+      return pp_lexer_ScanScalar(p, end, set);
+   mask = AVX2_HITS(_mm256_loadu_si256((const __m256i*)p));
+   if (mask)
+      return p + __builtin_ctz(mask);
+   block = (const __m256i*)(((uintptr_t)p + 32) & ~(uintptr_t)31);
+
+   while ((LPCSTR)(block + 1) <= end){
+      mask = AVX2_HITS(_mm256_load_si256(block));
+      if (mask)
+         return (LPCSTR)block + __builtin_ctz(mask);
+      block++;
+   }
+   return pp_lexer_ScanScalar((LPCSTR)block, end, set);
+}
+#endif
+
+/******************************************************************************
+*  ScanLevel -- Returns the fastest scanner that both the compiler and the CPU
+*  support.  The CPU is only asked once.
+******************************************************************************/
+PP_SCAN_LEVEL pp_lexer_ScanLevel(void)
+{
+#ifdef PP_SCAN_HAVE_AVX2
+   static int avx2 = -1;
+   if (avx2 < 0)
+      avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+   if (avx2)
+      return PP_SCAN_LEVEL_AVX2;
+#endif
+#ifdef __SSE2__
+   return PP_SCAN_LEVEL_SSE2;
+#else
+   return PP_SCAN_LEVEL_SCALAR;
+#endif
+}
+
+/******************************************************************************
+*  ScanAt -- Scans with a particular scanner, or the fastest one below it if
+*  it isn't supported.  Used by pp_lexer_Scan and to test the scanners
+*  against each other.
+******************************************************************************/
+LPCSTR pp_lexer_ScanAt(PP_SCAN_LEVEL level, LPCSTR p, LPCSTR end, PP_SCAN_SET set)
+{
+   if (level > pp_lexer_ScanLevel())
+      level = pp_lexer_ScanLevel();
+   switch(level){
+#ifdef PP_SCAN_HAVE_AVX2
+      case PP_SCAN_LEVEL_AVX2:
+         return pp_lexer_ScanAVX2(p, end, set);
+#endif
+#ifdef __SSE2__
+      case PP_SCAN_LEVEL_SSE2:
+         return pp_lexer_ScanSSE2(p, end, set);
+#endif
+      default:
+         return pp_lexer_ScanScalar(p, end, set);
+   }
+}
+
+LPCSTR pp_lexer_Scan(LPCSTR p, LPCSTR end, PP_SCAN_SET set)
+{
+   return pp_lexer_ScanAt(pp_lexer_ScanLevel(), p, end, set);
+}
+
 /******************************************************************************
 *  getNextToken -- Thie method searches the input stream and returns the next
 *  token found within that stream, using the principle of maximal munch.  It
-*  embodies the start state of the FSA.
+*  embodies the start state of the FSA, which dispatches on the class of the
+*  current character.
 *
 *  Parameters: theNextToken -- address of the next CToken found in the stream
 *  Returns: S_OK
@@ -111,383 +587,377 @@ void pp_lexer_Clear(pp_lexer* plexer)
 HRESULT pp_lexer_GetNextToken (pp_lexer* plexer, pp_token* theNextToken)
 {
    for(;;){
-      memset(plexer->theTokenSource, 0, MAX_PP_TOKEN_LENGTH * sizeof(CHAR));
-      plexer->theTokenPosition = plexer->theTextPosition;
       plexer->tokOffset = plexer->offset;
 
-      //Whenever we get a new token, we need to watch out for the end-of-input.
-      //Otherwise, we could walk right off the end of the stream.
-      if ( !strncmp( plexer->pcurChar, "\0", 1)){   //A null character marks the end of the stream
-         MAKETOKEN( PP_TOKEN_EOF );
-         return S_OK;
-      }
+      switch(CHARCLASS(CURCHAR))
+      {
+         //The end of the input, or a null character, marks the end of the
+         //stream.
+         case CC_END:
+            MAKETOKEN( PP_TOKEN_EOF );
+            return S_OK;
 
-      //Windows line break (\r\n)
-      else if ( !strncmp( plexer->pcurChar, "\r\n", 2)){
-         //interpret as a newline
-         plexer->theTokenSource[strlen(plexer->theTokenSource)] = '\n';
-         plexer->theTokenSource[strlen(plexer->theTokenSource)] = '\0';
-         plexer->theTextPosition.col = 0;
-         plexer->theTextPosition.row++;
-         plexer->pcurChar += 2;
-         plexer->offset += 2;
-         MAKETOKEN( PP_TOKEN_NEWLINE );
-         return S_OK;
-      }
-      
-      //newline (\n), carriage return (\r), or form feed (\f)
-      else if ( !strncmp( plexer->pcurChar, "\n", 1) || !strncmp( plexer->pcurChar, "\r", 1) || 
-      			!strncmp( plexer->pcurChar, "\f", 1)){
-         //interpret as a newline
-         plexer->theTokenSource[strlen(plexer->theTokenSource)] = '\n';
-         plexer->theTokenSource[strlen(plexer->theTokenSource)] = '\0';
-         plexer->theTextPosition.col = 0;
-         plexer->theTextPosition.row++;
-         plexer->pcurChar++;
-         plexer->offset++;
-         MAKETOKEN( PP_TOKEN_NEWLINE );
-         return S_OK;
-      }
+         //carriage return (\r), which might be part of a Windows line break (\r\n)
+         case CC_CARRIAGE_RETURN:
+            if(CHARAT(1) == '\n'){
+               plexer->pcurChar++;
+               plexer->offset++;
+            }
+            plexer->pcurChar++;
+            plexer->offset++;
+            MAKESYNTHTOKEN( PP_TOKEN_NEWLINE, "\n" );
+            return S_OK;
 
-      //tab
-      else if ( !strncmp( plexer->pcurChar, "\t", 1)){
-         //increment the offset counter by TABSIZE
-         plexer->theTokenSource[strlen(plexer->theTokenSource)] = *(plexer->pcurChar);
-         plexer->theTokenSource[strlen(plexer->theTokenSource)] = '\0';
-         plexer->theTextPosition.col += TABSIZE;
-         plexer->pcurChar++;
-         plexer->offset++;
-         MAKETOKEN( PP_TOKEN_WHITESPACE );
-         return S_OK;
-      }
+         //newline (\n) or form feed (\f)
+         case CC_NEWLINE:
+            //interpret as a newline; a plain "\n" is left as a view into the
+            //input so that it runs on from the tokens around it
+            plexer->pcurChar++;
+            plexer->offset++;
+            if (plexer->pcurChar[-1] == '\n'){
+               MAKETOKEN( PP_TOKEN_NEWLINE );
+            }
+            else{
+               MAKESYNTHTOKEN( PP_TOKEN_NEWLINE, "\n" );
+            }
+            return S_OK;
 
-      //space
-      else if ( !strncmp(plexer->pcurChar, " ", 1)){
-         //increment the offset counter
-         CONSUMECHARACTER;
-         MAKETOKEN( PP_TOKEN_WHITESPACE );
-         return S_OK;
-      }
+         //tab or space; with PP_LEXER_COALESCE_WHITESPACE, the whole run of
+         //them is a single token
+         case CC_TAB:
+         case CC_SPACE:
+            if (plexer->flags & PP_LEXER_COALESCE_WHITESPACE){
+               LPCSTR p = plexer->pcurChar, end = plexer->pend;
+               do{
+                  p++;
+               }while (p < end && (*p == ' ' || *p == '\t'));
+               CONSUMETO(p);
+            }
+            else{
+               CONSUMECHARACTER;
+            }
+            MAKETOKEN( PP_TOKEN_WHITESPACE );
+            return S_OK;
 
-      //an Identifier starts with an alphabetical character or underscore
-      else if ( *plexer->pcurChar=='_' || (*plexer->pcurChar>= 'a' && *plexer->pcurChar <= 'z') ||
-          (*plexer->pcurChar >= 'A' && *plexer->pcurChar <= 'Z')){
-         return pp_lexer_GetTokenIdentifier(plexer, theNextToken );
-      }
+         //an Identifier starts with an alphabetical character or underscore
+         case CC_ALPHA:
+            return pp_lexer_GetTokenIdentifier(plexer, theNextToken );
 
-      //a Number starts with a numerical character
-      else if ((*plexer->pcurChar >= '0' && *plexer->pcurChar <= '9') ){
-         return pp_lexer_GetTokenNumber(plexer, theNextToken );
-      }
-      //string
-      else if (!strncmp( plexer->pcurChar, "\"", 1)){
-         return pp_lexer_GetTokenStringLiteral(plexer, theNextToken );
-      }
-      //character
-      else if (!strncmp( plexer->pcurChar, "'", 1)){
-         CONSUMECHARACTER;
-         //escape characters
-         if (!strncmp( plexer->pcurChar, "\\", 1)){
-            CONSUMECHARACTER;
-            CONSUMECHARACTER;
-         }
-         //must not be an empty character
-         else if(strncmp( plexer->pcurChar, "'", 1))
-         {
-            CONSUMECHARACTER;
-         }
-         else
-         {
-            CONSUMECHARACTER;
-            CONSUMECHARACTER;
-            MAKETOKEN( PP_TOKEN_ERROR );
-            return S_OK;
-         }
-         if (!strncmp( plexer->pcurChar, "'", 1)){
-            CONSUMECHARACTER;
-            MAKETOKEN( PP_TOKEN_STRING_LITERAL );
-            return S_OK;
-         }
-         else{
+         //a Number starts with a numerical character
+         case CC_DIGIT:
+            if (plexer->flags & PP_LEXER_COARSE)
+               return pp_lexer_GetTokenPassThrough(plexer, theNextToken );
+            return pp_lexer_GetTokenNumber(plexer, theNextToken );
+
+         //string
+         case CC_QUOTE:
+            if (plexer->flags & PP_LEXER_COARSE)
+               return pp_lexer_GetTokenPassThrough(plexer, theNextToken );
+            return pp_lexer_GetTokenStringLiteral(plexer, theNextToken );
+
+         //character
+         case CC_APOSTROPHE:
             CONSUMECHARACTER;
+            //escape characters
+            if (CURCHAR == '\\'){
+               CONSUMECHARACTER;
+               CONSUMEUNLESSEND;
+            }
+            //must not be an empty character
+            else if(CURCHAR != '\'')
+            {
+               CONSUMEUNLESSEND;
+            }
+            else
+            {
+               CONSUMECHARACTER;
+               CONSUMEUNLESSEND;
+               MAKETOKEN( PP_TOKEN_ERROR );
+               return S_OK;
+            }
+            if (CURCHAR == '\''){
+               CONSUMECHARACTER;
+               MAKETOKEN( PP_TOKEN_STRING_LITERAL );
+               return S_OK;
+            }
+            else{
+               CONSUMEUNLESSEND;
+               CONSUMEUNLESSEND;
+               MAKETOKEN( PP_TOKEN_ERROR );
+               return S_OK;
+            }
+
+         //Before checking for symbols, check for comments
+         case CC_SLASH:
+            if (CHARAT(1) == '/'){
+               CONSUMECHARACTER;
+               pp_lexer_SkipComment(plexer, COMMENT_SLASH);
+               continue;
+            }
+            else if (CHARAT(1) == '*'){
+               CONSUMECHARACTER;
+               pp_lexer_SkipComment(plexer, COMMENT_STAR);
+               continue;
+            }
+            //fall through
+
+         //operators, punctuation, the end of a star comment, and preprocessor
+         //directives are all symbols
+         case CC_SYMBOL:
+            if ((plexer->flags & PP_LEXER_COARSE) && CURCHAR != '#')
+               return pp_lexer_GetTokenPassThrough(plexer, theNextToken );
+            return pp_lexer_GetTokenSymbol(plexer, theNextToken );
+
+         //If we get here, we've hit a character we don't recognize
+         default:
+            if ((plexer->flags & PP_LEXER_COARSE) && CURCHAR != '\\')
+               return pp_lexer_GetTokenPassThrough(plexer, theNextToken );
+
+            //Consume the character
             CONSUMECHARACTER;
+
+            /* Create an "error" token, but continue normally since unrecognized 
+             * characters are none of the preprocessor's business.  Scriptlib can 
+             * deal with them if necessary. */
             MAKETOKEN( PP_TOKEN_ERROR );
+            //HandleCompileError( *theNextToken, UNRECOGNIZED_CHARACTER );
             return S_OK;
-         }
       }
+   }
+}
 
-      //Before checking for comments
-      else if ( !strncmp( plexer->pcurChar, "/", 1)){
-         CONSUMECHARACTER;
-         if ( !strncmp( plexer->pcurChar, "/", 1)){
-            pp_lexer_SkipComment(plexer, COMMENT_SLASH);
-            //CONSUMECHARACTER;
-            //MAKETOKEN( PP_TOKEN_COMMENT_SLASH );
-            //return S_OK;
-         }
-         else if ( !strncmp( plexer->pcurChar, "*", 1)){
-            pp_lexer_SkipComment(plexer, COMMENT_STAR);
-            //CONSUMECHARACTER;
-            //MAKETOKEN( PP_TOKEN_COMMENT_STAR_BEGIN );
-            //return S_OK;
-         }
+/******************************************************************************
+*  Keywords -- Keywords are recognized with a perfect hash of an identifier's
+*  length and its first, second and last characters, so classifying an
+*  identifier costs one table lookup and at most one comparison no matter how
+*  many keywords there are.  The tables below are generated by
+*  test/pp_keyword_hash.c so that no two keywords share a slot.  To add,
+*  rename or remove a keyword, change the list in that program, build and run
+*  it on its own, and paste its output over everything from
+*  MIN_KEYWORD_LENGTH to the end of keywords[].  pp_scan_test checks that
+*  every keyword is still recognized.
+******************************************************************************/
+#define MIN_KEYWORD_LENGTH 2
+#define MAX_KEYWORD_LENGTH 8
+#define KEYWORD_HASH_SIZE 64
+
+static const unsigned char keywordAssoc[256] = {
+   ['a'] = 0, ['b'] = 22, ['c'] = 14, ['d'] = 1, ['e'] = 26, ['f'] = 0,
+   ['g'] = 0, ['h'] = 4, ['i'] = 1, ['k'] = 0, ['l'] = 0, ['m'] = 6,
+   ['n'] = 16, ['o'] = 5, ['p'] = 0, ['r'] = 12, ['s'] = 19, ['t'] = 12,
+   ['u'] = 20, ['v'] = 23, ['w'] = 8, ['x'] = 0, ['y'] = 9,
+};
+
+typedef struct pp_keyword {
+   LPCSTR name;
+   int length;
+   PP_TOKEN_TYPE type;
+} pp_keyword;
+
+static const pp_keyword keywords[KEYWORD_HASH_SIZE] = {
+   [3] = {"if", 2, PP_TOKEN_IF},
+   [6] = {"ifdef", 5, PP_TOKEN_IFDEF},
+   [7] = {"ifndef", 6, PP_TOKEN_IFNDEF},
+   [9] = {"long", 4, PP_TOKEN_LONG},
+   [13] = {"do", 2, PP_TOKEN_DO},
+   [14] = {"goto", 4, PP_TOKEN_GOTO},
+   [15] = {"warning", 7, PP_TOKEN_WARNING},
+   [17] = {"float", 5, PP_TOKEN_FLOAT},
+   [18] = {"pragma", 6, PP_TOKEN_PRAGMA},
+   [20] = {"for", 3, PP_TOKEN_FOR},
+   [26] = {"sizeof", 6, PP_TOKEN_SIZEOF},
+   [27] = {"signed", 6, PP_TOKEN_SIGNED},
+   [28] = {"typedef", 7, PP_TOKEN_TYPEDEF},
+   [29] = {"auto", 4, PP_TOKEN_AUTO},
+   [30] = {"elif", 4, PP_TOKEN_ELIF},
+   [32] = {"int", 3, PP_TOKEN_INT},
+   [33] = {"void", 4, PP_TOKEN_VOID},
+   [34] = {"char", 4, PP_TOKEN_CHAR},
+   [36] = {"const", 5, PP_TOKEN_CONST},
+   [37] = {"switch", 6, PP_TOKEN_SWITCH},
+   [38] = {"double", 6, PP_TOKEN_DOUBLE},
+   [39] = {"break", 5, PP_TOKEN_BREAK},
+   [40] = {"short", 5, PP_TOKEN_SHORT},
+   [41] = {"undef", 5, PP_TOKEN_UNDEF},
+   [43] = {"while", 5, PP_TOKEN_WHILE},
+   [44] = {"case", 4, PP_TOKEN_CASE},
+   [45] = {"unsigned", 8, PP_TOKEN_UNSIGNED},
+   [46] = {"default", 7, PP_TOKEN_DEFAULT},
+   [47] = {"endif", 5, PP_TOKEN_ENDIF},
+   [48] = {"extern", 6, PP_TOKEN_EXTERN},
+   [49] = {"struct", 6, PP_TOKEN_STRUCT},
+   [50] = {"include", 7, PP_TOKEN_INCLUDE},
+   [51] = {"static", 6, PP_TOKEN_STATIC},
+   [52] = {"enum", 4, PP_TOKEN_ENUM},
+   [53] = {"continue", 8, PP_TOKEN_CONTINUE},
+   [55] = {"error", 5, PP_TOKEN_ERROR_TEXT},
+   [56] = {"else", 4, PP_TOKEN_ELSE},
+   [57] = {"union", 5, PP_TOKEN_UNION},
+   [58] = {"register", 8, PP_TOKEN_REGISTER},
+   [59] = {"define", 6, PP_TOKEN_DEFINE},
+   [60] = {"return", 6, PP_TOKEN_RETURN},
+   [62] = {"volatile", 8, PP_TOKEN_VOLATILE},
+};
 
-         //Now complete the symbol scan for regular symbols.
-         else if ( !strncmp( plexer->pcurChar, "=", 1)){
-            CONSUMECHARACTER;
-            MAKETOKEN( PP_TOKEN_DIV_ASSIGN );
-            return S_OK;
-         }
-         else{
-            MAKETOKEN( PP_TOKEN_DIV );
-            return S_OK;
-         }
-      }
-      
-      //Check for the end of a star comment
-      else if ( !strncmp( plexer->pcurChar, "*/", 2)){
-         CONSUMECHARACTER;
-         CONSUMECHARACTER;
-         MAKETOKEN( PP_TOKEN_COMMENT_STAR_END );
-         return S_OK;
-      }
-      
-      //Preprocessor directive
-      else if ( !strncmp( plexer->pcurChar, "#", 1)){
-         CONSUMECHARACTER;
-         MAKETOKEN( PP_TOKEN_DIRECTIVE );
-         return S_OK;
-      }
+/******************************************************************************
+*  ClassifyIdentifier -- Returns the keyword type of an identifier, or
+*  PP_TOKEN_IDENTIFIER if it isn't a keyword.  Note that PP_TOKEN_ERROR_TEXT
+*  ("error") is completely different from PP_TOKEN_ERROR!
+*  Parameters: theSource -- the identifier, which doesn't need to be
+*                           NUL-terminated
+*              theLength -- the length of the identifier
+******************************************************************************/
+PP_TOKEN_TYPE pp_lexer_ClassifyIdentifier(LPCSTR theSource, int theLength)
+{
+   unsigned int hash;
+   const pp_keyword* keyword;
 
-      //a Symbol starts with one of these characters
-      else if (( !strncmp( plexer->pcurChar, ">", 1)) || ( !strncmp( plexer->pcurChar, "<", 1))
-         || ( !strncmp( plexer->pcurChar, "+", 1)) || ( !strncmp( plexer->pcurChar, "-", 1))
-         || ( !strncmp( plexer->pcurChar, "*", 1)) || ( !strncmp( plexer->pcurChar, "/", 1))
-         || ( !strncmp( plexer->pcurChar, "%", 1)) || ( !strncmp( plexer->pcurChar, "&", 1))
-         || ( !strncmp( plexer->pcurChar, "^", 1)) || ( !strncmp( plexer->pcurChar, "|", 1))
-         || ( !strncmp( plexer->pcurChar, "=", 1)) || ( !strncmp( plexer->pcurChar, "!", 1))
-         || ( !strncmp( plexer->pcurChar, ";", 1)) || ( !strncmp( plexer->pcurChar, "{", 1))
-         || ( !strncmp( plexer->pcurChar, "}", 1)) || ( !strncmp( plexer->pcurChar, ",", 1))
-         || ( !strncmp( plexer->pcurChar, ":", 1)) || ( !strncmp( plexer->pcurChar, "(", 1))
-         || ( !strncmp( plexer->pcurChar, ")", 1)) || ( !strncmp( plexer->pcurChar, "[", 1))
-         || ( !strncmp( plexer->pcurChar, "]", 1)) || ( !strncmp( plexer->pcurChar, ".", 1))
-         || ( !strncmp( plexer->pcurChar, "~", 1)) || ( !strncmp( plexer->pcurChar, "?", 1)))
-      {
-         return pp_lexer_GetTokenSymbol(plexer, theNextToken );
-      }
+   if (theLength < MIN_KEYWORD_LENGTH || theLength > MAX_KEYWORD_LENGTH)
+      return PP_TOKEN_IDENTIFIER;
 
-      //If we get here, we've hit a character we don't recognize
-      else{
-         //Consume the character
-         CONSUMECHARACTER;
+   hash = theLength + keywordAssoc[(unsigned char)theSource[0]] +
+          keywordAssoc[(unsigned char)theSource[1]] +
+          keywordAssoc[(unsigned char)theSource[theLength - 1]];
+   if (hash >= KEYWORD_HASH_SIZE)
+      return PP_TOKEN_IDENTIFIER;
 
-         /* Create an "error" token, but continue normally since unrecognized 
-          * characters are none of the preprocessor's business.  Scriptlib can 
-          * deal with them if necessary. */
-         MAKETOKEN( PP_TOKEN_ERROR );
-         //HandleCompileError( *theNextToken, UNRECOGNIZED_CHARACTER );
-         return S_OK;
-      }
-   }
+   keyword = &keywords[hash];
+   if (keyword->length == theLength && !memcmp(keyword->name, theSource, theLength))
+      return keyword->type;
+
+   return PP_TOKEN_IDENTIFIER;
 }
 
 /******************************************************************************
 *  Identifier -- This method extracts an identifier from the stream, once it's
 *  recognized as an identifier.  After it is extracted, this method determines
-*  if the identifier is a keyword.
+*  if the identifier is a keyword, and if it isn't and the lexer has an intern
+*  table, looks up the identifier's atom.
 *  Parameters: theNextToken -- address of the next CToken found in the stream
 *  Returns: S_OK
 *           E_FAIL
 ******************************************************************************/
 HRESULT pp_lexer_GetTokenIdentifier(pp_lexer* plexer, pp_token* theNextToken)
 {
+   LPCSTR p = plexer->pcurChar, end = plexer->pend;
+
    //copy the source that makes up this token
    //an identifier is a string of letters, digits and/or underscores
    do{
-      CONSUMECHARACTER;
-   }while ((*plexer->pcurChar >= '0' && *plexer->pcurChar <= '9')  ||
-       (*plexer->pcurChar >= 'a' && *plexer->pcurChar <= 'z')  ||
-       (*plexer->pcurChar >= 'A' && *plexer->pcurChar <= 'Z') ||
-      ( !strncmp( plexer->pcurChar, "_", 1)));
+      p++;
+   }while (p < end && ISIDENTCHAR(*p));
+   CONSUMETO(p);
 
    //Check the Identifier against current keywords
-   if (!strcmp( plexer->theTokenSource, "auto")){
-      MAKETOKEN( PP_TOKEN_AUTO );}
-   else if (!strcmp( plexer->theTokenSource, "break")){
-      MAKETOKEN( PP_TOKEN_BREAK );}
-   else if (!strcmp( plexer->theTokenSource, "case")){
-      MAKETOKEN( PP_TOKEN_CASE );}
-   else if (!strcmp( plexer->theTokenSource, "char")){
-      MAKETOKEN( PP_TOKEN_CHAR );}
-   else if (!strcmp( plexer->theTokenSource, "const")){
-      MAKETOKEN( PP_TOKEN_CONST );}
-   else if (!strcmp( plexer->theTokenSource, "continue")){
-      MAKETOKEN( PP_TOKEN_CONTINUE );}
-   else if (!strcmp( plexer->theTokenSource, "default")){
-      MAKETOKEN( PP_TOKEN_DEFAULT );}
-   else if (!strcmp( plexer->theTokenSource, "do")){
-      MAKETOKEN( PP_TOKEN_DO );}
-   else if (!strcmp( plexer->theTokenSource, "double")){
-      MAKETOKEN( PP_TOKEN_DOUBLE );}
-   else if (!strcmp( plexer->theTokenSource, "else")){
-      MAKETOKEN( PP_TOKEN_ELSE );}
-   else if (!strcmp( plexer->theTokenSource, "enum")){
-      MAKETOKEN( PP_TOKEN_ENUM );}
-   else if (!strcmp( plexer->theTokenSource, "extern")){
-      MAKETOKEN( PP_TOKEN_EXTERN );}
-   else if (!strcmp( plexer->theTokenSource, "float")){
-      MAKETOKEN( PP_TOKEN_FLOAT );}
-   else if (!strcmp( plexer->theTokenSource, "for")){
-      MAKETOKEN( PP_TOKEN_FOR );}
-   else if (!strcmp( plexer->theTokenSource, "goto")){
-      MAKETOKEN( PP_TOKEN_GOTO );}
-   else if (!strcmp( plexer->theTokenSource, "if")){
-      MAKETOKEN( PP_TOKEN_IF );}
-   else if (!strcmp( plexer->theTokenSource, "int")){
-      MAKETOKEN( PP_TOKEN_INT );}
-   else if (!strcmp( plexer->theTokenSource, "long")){
-      MAKETOKEN( PP_TOKEN_LONG );}
-   else if (!strcmp( plexer->theTokenSource, "register")){
-      MAKETOKEN( PP_TOKEN_REGISTER );}
-   else if (!strcmp( plexer->theTokenSource, "return")){
-      MAKETOKEN( PP_TOKEN_RETURN );}
-   else if (!strcmp( plexer->theTokenSource, "short")){
-      MAKETOKEN( PP_TOKEN_SHORT );}
-   else if (!strcmp( plexer->theTokenSource, "signed")){
-      MAKETOKEN( PP_TOKEN_SIGNED );}
-   else if (!strcmp( plexer->theTokenSource, "sizeof")){
-      MAKETOKEN( PP_TOKEN_SIZEOF );}
-   else if (!strcmp( plexer->theTokenSource, "static")){
-      MAKETOKEN( PP_TOKEN_STATIC );}
-   else if (!strcmp( plexer->theTokenSource, "struct")){
-      MAKETOKEN( PP_TOKEN_STRUCT );}
-   else if (!strcmp( plexer->theTokenSource, "switch")){
-      MAKETOKEN( PP_TOKEN_SWITCH );}
-   else if (!strcmp( plexer->theTokenSource, "typedef")){
-      MAKETOKEN( PP_TOKEN_TYPEDEF );}
-   else if (!strcmp( plexer->theTokenSource, "union")){
-      MAKETOKEN( PP_TOKEN_UNION );}
-   else if (!strcmp( plexer->theTokenSource, "unsigned")){
-      MAKETOKEN( PP_TOKEN_UNSIGNED );}
-   else if (!strcmp( plexer->theTokenSource, "void")){
-      MAKETOKEN( PP_TOKEN_VOID );}
-   else if (!strcmp( plexer->theTokenSource, "volatile")){
-      MAKETOKEN( PP_TOKEN_VOLATILE );}
-   else if (!strcmp( plexer->theTokenSource, "while")){
-      MAKETOKEN( PP_TOKEN_WHILE );}
-   else if (!strcmp( plexer->theTokenSource, "include")){
-      MAKETOKEN( PP_TOKEN_INCLUDE );}
-   else if (!strcmp( plexer->theTokenSource, "define")){
-      MAKETOKEN( PP_TOKEN_DEFINE );}
-   else if (!strcmp( plexer->theTokenSource, "undef")){
-      MAKETOKEN( PP_TOKEN_UNDEF );}
-   else if (!strcmp( plexer->theTokenSource, "pragma")){
-      MAKETOKEN( PP_TOKEN_PRAGMA );}
-   else if (!strcmp( plexer->theTokenSource, "ifdef")){
-      MAKETOKEN( PP_TOKEN_IFDEF );}
-   else if (!strcmp( plexer->theTokenSource, "ifndef")){
-      MAKETOKEN( PP_TOKEN_IFNDEF );}
-   else if (!strcmp( plexer->theTokenSource, "elif")){
-      MAKETOKEN( PP_TOKEN_ELIF );}
-   else if (!strcmp( plexer->theTokenSource, "endif")){
-      MAKETOKEN( PP_TOKEN_ENDIF );}
-   else if (!strcmp( plexer->theTokenSource, "warning")){
-      MAKETOKEN( PP_TOKEN_WARNING );}
-   else if (!strcmp( plexer->theTokenSource, "error")){
-      MAKETOKEN( PP_TOKEN_ERROR_TEXT );} // this is completely different from PP_TOKEN_ERROR!
-   else{
-      MAKETOKEN( PP_TOKEN_IDENTIFIER );}
+   MAKETOKEN( pp_lexer_ClassifyIdentifier(plexer->ptheSource + plexer->tokOffset,
+                                          plexer->offset - plexer->tokOffset) );
+
+   if (plexer->atoms && theNextToken->theType == PP_TOKEN_IDENTIFIER){
+      theNextToken->theAtom = pp_intern(plexer->atoms, theNextToken->theSource, theNextToken->theLength);
+      if (!theNextToken->theAtom)
+         return E_FAIL;
+   }
 
    return S_OK;
 }
 
 /******************************************************************************
-*  Number -- This method extracts a numerical constant from the stream.  It
-*  only extracts the digits that make up the number.  No conversion from string
-*  to numeral is performed here.
-*  Parameters: theNextToken -- address of the next CToken found in the stream
-*  Returns: S_OK
-*           E_FAIL
+*  ConsumeNumber -- Consumes the characters of a numerical constant and
+*  returns its type, without making a token of it.
 ******************************************************************************/
-HRESULT pp_lexer_GetTokenNumber(pp_lexer* plexer, pp_token* theNextToken)
+static PP_TOKEN_TYPE pp_lexer_ConsumeNumber(pp_lexer* plexer)
 {
-   //copy the source that makes up this token
    //a constant is one of these:
 
    //0[xX][a-fA-F0-9]+{u|U|l|L}
    //0{D}+{u|U|l|L}
-   if (( !strncmp( plexer->pcurChar, "0X", 2)) || ( !strncmp( plexer->pcurChar, "0x", 2))){
+   if (CURCHAR == '0' && (CHARAT(1) == 'X' || CHARAT(1) == 'x')){
       CONSUMECHARACTER;
       CONSUMECHARACTER;
-      while ((*plexer->pcurChar >= '0' && *plexer->pcurChar <= '9') ||
-          (*plexer->pcurChar >= 'a' && *plexer->pcurChar <= 'f') ||
-          (*plexer->pcurChar >= 'A' && *plexer->pcurChar <= 'F'))
+      while ((CURCHAR >= '0' && CURCHAR <= '9') ||
+          (CURCHAR >= 'a' && CURCHAR <= 'f') ||
+          (CURCHAR >= 'A' && CURCHAR <= 'F'))
       {
          CONSUMECHARACTER;
       }
 
-      if (( !strncmp( plexer->pcurChar, "u", 1)) || ( !strncmp( plexer->pcurChar, "U", 1)) ||
-         ( !strncmp( plexer->pcurChar, "l", 1)) || ( !strncmp( plexer->pcurChar, "L", 1)))
+      if (( CURCHAR == 'u') || ( CURCHAR == 'U') ||
+         ( CURCHAR == 'l') || ( CURCHAR == 'L'))
       {
          CONSUMECHARACTER;
       }
 
-      MAKETOKEN( PP_TOKEN_HEXCONSTANT );
+      return PP_TOKEN_HEXCONSTANT;
    }
    else{
-      while (*plexer->pcurChar >= '0' && *plexer->pcurChar <= '9')
+      while (ISDIGIT(CURCHAR))
       {
          CONSUMECHARACTER;
       }
 
-      if (( !strncmp( plexer->pcurChar, "E", 1)) || ( !strncmp( plexer->pcurChar, "e", 1)))
+      if (( CURCHAR == 'E') || ( CURCHAR == 'e'))
       {
          CONSUMECHARACTER;
-         while (*plexer->pcurChar >= '0' && *plexer->pcurChar <= '9')
+         while (ISDIGIT(CURCHAR))
          {
             CONSUMECHARACTER;
          }
 
-         if (( !strncmp( plexer->pcurChar, "f", 1)) || ( !strncmp( plexer->pcurChar, "F", 1)) ||
-            ( !strncmp( plexer->pcurChar, "l", 1)) || ( !strncmp( plexer->pcurChar, "L", 1)))
+         if (( CURCHAR == 'f') || ( CURCHAR == 'F') ||
+            ( CURCHAR == 'l') || ( CURCHAR == 'L'))
          {
             CONSUMECHARACTER;
          }
 
-         MAKETOKEN( PP_TOKEN_FLOATCONSTANT );
+         return PP_TOKEN_FLOATCONSTANT;
       }
-      else if ( !strncmp( plexer->pcurChar, ".", 1))
+      else if ( CURCHAR == '.')
       {
          CONSUMECHARACTER;
-         while (*plexer->pcurChar >= '0' && *plexer->pcurChar <= '9')
+         while (ISDIGIT(CURCHAR))
          {
             CONSUMECHARACTER;
          }
 
-         if (( !strncmp( plexer->pcurChar, "E", 1)) || ( !strncmp( plexer->pcurChar, "e", 1)))
+         if (( CURCHAR == 'E') || ( CURCHAR == 'e'))
          {
             CONSUMECHARACTER;
 
-            while (*plexer->pcurChar >= '0' && *plexer->pcurChar <= '9')
+            while (ISDIGIT(CURCHAR))
             {
                CONSUMECHARACTER;
             }
 
-            if (( !strncmp( plexer->pcurChar, "f", 1)) ||
-               ( !strncmp( plexer->pcurChar, "F", 1)) ||
-               ( !strncmp( plexer->pcurChar, "l", 1)) ||
-               ( !strncmp( plexer->pcurChar, "L", 1)))
+            if (( CURCHAR == 'f') ||
+               ( CURCHAR == 'F') ||
+               ( CURCHAR == 'l') ||
+               ( CURCHAR == 'L'))
             {
                CONSUMECHARACTER;
             }
          }
-         MAKETOKEN( PP_TOKEN_FLOATCONSTANT );
-
+         return PP_TOKEN_FLOATCONSTANT;
       }
       else{
-         MAKETOKEN( PP_TOKEN_INTCONSTANT );
+         return PP_TOKEN_INTCONSTANT;
       }
    }
+}
+
+/******************************************************************************
+*  Number -- This method extracts a numerical constant from the stream.  It
+*  only extracts the digits that make up the number.  No conversion from string
+*  to numeral is performed here.
+*  Parameters: theNextToken -- address of the next CToken found in the stream
+*  Returns: S_OK
+*           E_FAIL
+******************************************************************************/
+HRESULT pp_lexer_GetTokenNumber(pp_lexer* plexer, pp_token* theNextToken)
+{
+   //copy the source that makes up this token
+   PP_TOKEN_TYPE theType = pp_lexer_ConsumeNumber(plexer);
+
+   MAKETOKEN( theType );
    return S_OK;
 }
 
@@ -498,358 +968,130 @@ HRESULT pp_lexer_GetTokenNumber(pp_lexer* plexer, pp_token* theNextToken)
 *  Returns: S_OK
 *           E_FAIL
 ******************************************************************************/
-HRESULT pp_lexer_GetTokenStringLiteral(pp_lexer* plexer, pp_token* theNextToken)
+static void pp_lexer_ConsumeStringLiteral(pp_lexer* plexer)
 {
-   //copy the source that makes up this token
-   //an identifier is a string of letters, digits and/or underscores
    //consume that first quote mark
-   int esc = 0;
    CONSUMECHARACTER;
-   while ( strncmp( plexer->pcurChar, "\"", 1))
+   for(;;)
    {
-      if(!strncmp( plexer->pcurChar, "\\", 1))
+      //jump to the next quote mark, backslash or end of stream
+      CONSUMETO(pp_lexer_Scan(plexer->pcurChar, plexer->pend, PP_SCAN_STRING));
+
+      //consume that last quote mark
+      if (CURCHAR == '"')
       {
-          esc = 1;
+         CONSUMECHARACTER;
+         break;
       }
+      //an unterminated string ends with the stream
+      else if (CURCHAR == '\0')
+         break;
+
+      //escape sequence: consume the backslash and the escaped character
       CONSUMECHARACTER;
-      if(esc)
+      if (CURCHAR != '\0')
       {
-        CONSUMECHARACTER;
-        esc = 0;
+         CONSUMECHARACTER;
       }
    }
+}
 
-   //consume that last quote mark
-   CONSUMECHARACTER;
-
+HRESULT pp_lexer_GetTokenStringLiteral(pp_lexer* plexer, pp_token* theNextToken)
+{
+   pp_lexer_ConsumeStringLiteral(plexer);
    MAKETOKEN( PP_TOKEN_STRING_LITERAL );
    return S_OK;
 }
 /******************************************************************************
-*  Symbol -- This method extracts a symbol from the character stream.  For the
-*  purposes of lexing, comments are considered symbols.
+*  Symbol -- This method extracts a symbol from the character stream by running
+*  the symbol DFA from the current character until the symbol can't be
+*  extended any further.  For the purposes of lexing, the end of a star comment
+*  and the preprocessor directive marker are considered symbols.
 *  Parameters: theNextToken -- address of the next CToken found in the stream
 *  Returns: S_OK
 *           E_FAIL
 ******************************************************************************/
 HRESULT pp_lexer_GetTokenSymbol(pp_lexer* plexer, pp_token* theNextToken)
 {
-   //">>="
-   if ( !strncmp( plexer->pcurChar, ">>=", 3))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_RIGHT_ASSIGN );
-   }
+   unsigned char state = symbolStart[(unsigned char)CURCHAR];
+   unsigned char next;
 
-   //">>"
-   else if ( !strncmp( plexer->pcurChar, ">>", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_RIGHT_OP );
-   }
+   if(state == SS_NONE) return E_FAIL;
 
-   //">="
-   else if ( !strncmp( plexer->pcurChar, ">=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_GE_OP );
-   }
-
-   //">"
-   else if ( !strncmp( plexer->pcurChar, ">", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_GT );
-   }
-
-   //"<<="
-   else if ( !strncmp( plexer->pcurChar, "<<=", 3))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_LEFT_ASSIGN );
-   }
-
-   //"<<"
-   else if ( !strncmp( plexer->pcurChar, "<<", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_LEFT_OP );
-   }
-
-   //"<="
-   else if ( !strncmp( plexer->pcurChar, "<=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_LE_OP );
-   }
-
-   //"<"
-   else if ( !strncmp( plexer->pcurChar, "<", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_LT );
-   }
-
-   //"++"
-   else if ( !strncmp( plexer->pcurChar, "++", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_INC_OP );
-   }
-
-   //"+="
-   else if ( !strncmp( plexer->pcurChar, "+=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_ADD_ASSIGN );
-   }
-
-   //"+"
-   else if ( !strncmp( plexer->pcurChar, "+", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_ADD );
-   }
-
-   //"--"
-   else if ( !strncmp( plexer->pcurChar, "--", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_DEC_OP );
-   }
-
-   //"-="
-   else if ( !strncmp( plexer->pcurChar, "-=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_SUB_ASSIGN );
-   }
-
-   //"-"
-   else if ( !strncmp( plexer->pcurChar, "-", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_SUB );
-   }
-
-   //"*="
-   else if ( !strncmp( plexer->pcurChar, "*=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_MUL_ASSIGN );
-   }
-
-   //"*"
-   else if ( !strncmp( plexer->pcurChar, "*", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_MUL );
-   }
-
-   //"%="
-   else if ( !strncmp( plexer->pcurChar, "%=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_MOD_ASSIGN );
-   }
-
-   //"%"
-   else if ( !strncmp( plexer->pcurChar, "%", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_MOD );
-   }
-
-   //"&&"
-   else if ( !strncmp( plexer->pcurChar, "&&", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_AND_OP );
-   }
-
-   //"&="
-   else if ( !strncmp( plexer->pcurChar, "&=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_AND_ASSIGN );
-   }
-
-   //"&"
-   else if ( !strncmp( plexer->pcurChar, "&", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_BITWISE_AND );
-   }
-
-   //"^="
-   else if ( !strncmp( plexer->pcurChar, "^=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_XOR_ASSIGN );
-   }
-
-   //"^"
-   else if ( !strncmp( plexer->pcurChar, "^", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_XOR );
-   }
-
-   //"||"
-   else if ( !strncmp( plexer->pcurChar, "||", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_OR_OP );
-   }
-
-   //"|="
-   else if ( !strncmp( plexer->pcurChar, "|=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_OR_ASSIGN );
-   }
-
-    //"|"
-   else if ( !strncmp( plexer->pcurChar, "|", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_BITWISE_OR );
-   }
-
-   //"=="
-   else if ( !strncmp( plexer->pcurChar, "==", 2))
-
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_EQ_OP );
-   }
-
-  //"="
-   else if ( !strncmp( plexer->pcurChar, "=", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_ASSIGN );
-   }
-
-   //"!="
-   else if ( !strncmp( plexer->pcurChar, "!=", 2))
-   {
-      CONSUMECHARACTER;
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_NE_OP );
-   }
-
-   //"!"
-   else if ( !strncmp( plexer->pcurChar, "!", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_BOOLEAN_NOT );
-   }
-
-   //";"
-   else if ( !strncmp( plexer->pcurChar, ";", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_SEMICOLON);
-   }
-
-   //"{"
-   else if ( !strncmp( plexer->pcurChar, "{", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_LCURLY);
-   }
-
-   //"}"
-   else if ( !strncmp( plexer->pcurChar, "}", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_RCURLY);
-   }
-
-   //","
-   else if ( !strncmp( plexer->pcurChar, ",", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_COMMA);
-   }
-
-   //":"
-   else if ( !strncmp( plexer->pcurChar, ":", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_COLON);
-   }
-
-   //"("
-   else if ( !strncmp( plexer->pcurChar, "(", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_LPAREN);
-   }
-
-   //")"
-   else if ( !strncmp( plexer->pcurChar, ")", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_RPAREN);
-   }
-
-   //"["
-   else if ( !strncmp( plexer->pcurChar, "[", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_LBRACKET);
-   }
-
-   //"]"
-   else if ( !strncmp( plexer->pcurChar, "]", 1))
-   {
+   do{
       CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_RBRACKET);
-   }
+      next = symbolTransition[state][symbolClass[(unsigned char)CURCHAR]];
+      if(next == SS_NONE) break;
+      state = next;
+   }while(1);
 
-   //"."
-   else if ( !strncmp( plexer->pcurChar, ".", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_FIELD);
-   }
+   MAKETOKEN( symbolToken[state] );
+   return S_OK;
+}
 
-   //"~"
-   else if ( !strncmp( plexer->pcurChar, "~", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_BITWISE_NOT);
-   }
+/******************************************************************************
+*  PassThrough -- In coarse mode (PP_LEXER_COARSE), this method extracts the
+*  longest run of text that the preprocessor has no reason to look inside:
+*  operators, numbers, string literals, keywords and the whitespace between
+*  them.  The run stops before anything the preprocessor does care about,
+*  which is an identifier, a line break, a comment, '#', '\\', a character
+*  literal or the end of the stream.  It is split exactly where the full lexer
+*  would split it, so "*" "/" is still the end of a comment and never the start
+*  of one, and an identifier is never found inside a number.
+*  Parameters: theNextToken -- address of the next CToken found in the stream
+*  Returns: S_OK
+******************************************************************************/
+HRESULT pp_lexer_GetTokenPassThrough(pp_lexer* plexer, pp_token* theNextToken)
+{
+   LPCSTR p;
 
-   //"?"
-   else if ( !strncmp( plexer->pcurChar, "?", 1))
-   {
-      CONSUMECHARACTER;
-      MAKETOKEN( PP_TOKEN_CONDITIONAL);
+   for(;;){
+      switch(CHARCLASS(CURCHAR))
+      {
+         case CC_TAB:
+         case CC_SPACE:
+            CONSUMECHARACTER;
+            break;
+         case CC_DIGIT:
+            pp_lexer_ConsumeNumber(plexer);
+            break;
+         case CC_QUOTE:
+            pp_lexer_ConsumeStringLiteral(plexer);
+            break;
+         //keywords can't be macros, so only identifiers end the run
+         case CC_ALPHA:
+            p = plexer->pcurChar;
+            while (p < plexer->pend && ISIDENTCHAR(*p))
+               p++;
+            if (pp_lexer_ClassifyIdentifier(plexer->pcurChar, p - plexer->pcurChar) == PP_TOKEN_IDENTIFIER)
+               goto done;
+            CONSUMETO(p);
+            break;
+         case CC_SLASH:
+            if (CHARAT(1) == '/' || CHARAT(1) == '*')
+               goto done;
+            CONSUMECHARACTER;
+            break;
+         case CC_SYMBOL:
+            if (CURCHAR == '#')
+               goto done;
+            if (CURCHAR == '*' && CHARAT(1) == '/'){
+               CONSUMECHARACTER;
+            }
+            CONSUMECHARACTER;
+            break;
+         case CC_OTHER:
+            if (CURCHAR == '\\')
+               goto done;
+            CONSUMECHARACTER;
+            break;
+         default:
+            goto done;
+      }
    }
 
+done:
+   MAKETOKEN( PP_TOKEN_PASSTHROUGH );
    return S_OK;
 }
 
@@ -863,51 +1105,116 @@ HRESULT pp_lexer_SkipComment(pp_lexer* plexer, COMMENT_TYPE theType)
 {
 
    if (theType == COMMENT_SLASH){
-      do{
-         SKIPCHARACTER;
-         //break out if we hit a new line
-         if (!strncmp( plexer->pcurChar, "\n", 1)){
-            plexer->theTextPosition.col = 0;
-            plexer->theTextPosition.row++;
-            break;
-         }
-         else if (!strncmp( plexer->pcurChar, "\r", 1)){
-            plexer->theTextPosition.col = 0;
-            //plexer->theTextPosition.row++;
-            break;
-         }
-         else if (!strncmp( plexer->pcurChar, "\f", 1)){
-            plexer->theTextPosition.row++;
-            break;
-         }
-      }while (strncmp( plexer->pcurChar, "\0", 1));
+      //skip the second '/' and jump to the end of the line
+      SKIPCHARACTER;
+      //the line break itself is left for the next token
+      SKIPTO(pp_lexer_Scan(plexer->pcurChar, plexer->pend, PP_SCAN_LINE_COMMENT));
    }
    else if (theType == COMMENT_STAR){
       //consume the '*' that gets this comment started
       SKIPCHARACTER;
 
-      //loop through the characters till we hit '*/'
-      while (strncmp( plexer->pcurChar, "\0", 1)){
-         if (0==strncmp( plexer->pcurChar, "*/", 2)){
+      //jump from one '*' to the next till we hit '*/'
+      for(;;){
+         SKIPTO(pp_lexer_Scan(plexer->pcurChar, plexer->pend, PP_SCAN_STAR_COMMENT));
+         if (CURCHAR == '\0'){
+            break;
+         }
+         else if (CHARAT(1) == '/'){
             SKIPCHARACTER;
             SKIPCHARACTER;
             break;
          }
-         else if (!strncmp( plexer->pcurChar, "\n", 1)){
-            plexer->theTextPosition.col = 0;
-            plexer->theTextPosition.row++;
-         }
-         else if (!strncmp( plexer->pcurChar, "\r", 1)){
-            plexer->theTextPosition.col = 0;
-            //plexer->theTextPosition.row++;
-         }
-         else if (!strncmp( plexer->pcurChar, "\f", 1)){
-            plexer->theTextPosition.row++;
-         }
          SKIPCHARACTER;
-      };
+      }
    }
 
    return S_OK;
 }
 
+/******************************************************************************
+*  Grow -- Doubles the capacity of a token stream, so that appending tokens is
+*  amortized O(1).
+******************************************************************************/
+static HRESULT pp_token_stream_Grow(pp_token_stream* pstream)
+{
+   int capacity = pstream->capacity ? pstream->capacity * 2 : 256;
+   uint8_t* types;
+   uint32_t* offsets;
+   uint32_t* lengths;
+
+   //each array keeps its old contents if another one can't be enlarged
+   types = tracerealloc(pstream->types, capacity * sizeof(uint8_t), pstream->capacity * sizeof(uint8_t));
+   if (types) pstream->types = types;
+   offsets = tracerealloc(pstream->offsets, capacity * sizeof(uint32_t), pstream->capacity * sizeof(uint32_t));
+   if (offsets) pstream->offsets = offsets;
+   lengths = tracerealloc(pstream->lengths, capacity * sizeof(uint32_t), pstream->capacity * sizeof(uint32_t));
+   if (lengths) pstream->lengths = lengths;
+
+   if (!types || !offsets || !lengths)
+      return E_FAIL;
+   pstream->capacity = capacity;
+   return S_OK;
+}
+
+/******************************************************************************
+*  LexAll -- This method tokenizes the rest of the lexer's input in one pass
+*  and stores the tokens in a pp_token_stream, which can then be iterated over
+*  (or replayed with pp_token_stream_GetToken) any number of times without
+*  lexing the input again.  The last token in the stream is always
+*  PP_TOKEN_EOF.  The lexer's flags apply as usual.
+*  Parameters: pstream -- an initialized stream; any tokens it already holds
+*                         are discarded
+*  Returns: S_OK
+*           E_FAIL if the lexer fails or the stream can't be enlarged
+******************************************************************************/
+HRESULT pp_lexer_LexAll(pp_lexer* plexer, pp_token_stream* pstream)
+{
+   pp_token token;
+
+   pstream->ptheSource = plexer->ptheSource;
+   pstream->count = 0;
+
+   do{
+      if (FAILED(pp_lexer_GetNextToken(plexer, &token)))
+         return E_FAIL;
+
+      if (pstream->count == pstream->capacity && FAILED(pp_token_stream_Grow(pstream)))
+         return E_FAIL;
+
+      pstream->types[pstream->count] = token.theType;
+      pstream->offsets[pstream->count] = plexer->tokOffset;
+      pstream->lengths[pstream->count] = plexer->offset - plexer->tokOffset;
+      pstream->count++;
+   }while (token.theType != PP_TOKEN_EOF);
+
+   return S_OK;
+}
+
+void pp_token_stream_Init(pp_token_stream* pstream)
+{
+   memset(pstream, 0, sizeof(pp_token_stream));
+}
+
+void pp_token_stream_Clear(pp_token_stream* pstream)
+{
+   if (pstream->types) tracefree(pstream->types);
+   if (pstream->offsets) tracefree(pstream->offsets);
+   if (pstream->lengths) tracefree(pstream->lengths);
+   memset(pstream, 0, sizeof(pp_token_stream));
+}
+
+/******************************************************************************
+*  GetToken -- This method fills in a pp_token for one token of a stream, as
+*  pp_lexer_GetNextToken would have.
+*  Parameters: index -- the index of the token, from 0 to count-1
+*              ptoken -- the token to fill in
+******************************************************************************/
+void pp_token_stream_GetToken(const pp_token_stream* pstream, int index, pp_token* ptoken)
+{
+   if (pstream->types[index] == PP_TOKEN_NEWLINE)
+      pp_token_Init(ptoken, PP_TOKEN_NEWLINE, "\n", 1, pstream->offsets[index]);
+   else
+      pp_token_Init(ptoken, pstream->types[index], pstream->ptheSource + pstream->offsets[index],
+                    pstream->lengths[index], pstream->offsets[index]);
+}
@@ -19,8 +19,10 @@
 #ifndef PP_LEXER_H
 #define PP_LEXER_H
 
+#include <stdint.h>
 #include "depends.h"
 #include "Lexer.h"
+#include "pp_intern.h"
 
 // define some values for use in CLexer
 #define MAX_PP_TOKEN_LENGTH MAX_STR_LEN
@@ -52,20 +54,36 @@ typedef enum PP_TOKEN_TYPE {
       PP_TOKEN_COMMENT_STAR_END, PP_TOKEN_NEWLINE, PP_TOKEN_WHITESPACE, PP_TOKEN_DIRECTIVE,
       PP_TOKEN_INCLUDE, PP_TOKEN_DEFINE, PP_TOKEN_UNDEF, PP_TOKEN_PRAGMA, PP_TOKEN_ELIF, 
       PP_TOKEN_IFDEF, PP_TOKEN_IFNDEF, PP_TOKEN_ENDIF, PP_TOKEN_WARNING, PP_TOKEN_ERROR_TEXT,
-      PP_TOKEN_EOF, PP_EPSILON, PP_END_OF_TOKENS
+      PP_TOKEN_PASSTHROUGH, PP_TOKEN_EOF, PP_EPSILON, PP_END_OF_TOKENS
 }PP_TOKEN_TYPE;
 
 /******************************************************************************
 *  CToken -- This class encapsulates the tokens that CLexer creates.  It serves
-*  to encapsulate the information for OOD purposes.
+*  to encapsulate the information for OOD purposes.  The source of a token is
+*  a view into the text it was lexed from and is NOT NUL-terminated; it stays
+*  valid only as long as that text does.  Identifiers lexed with an intern
+*  table also have an atom; theAtom is 0 for every other token.
 ******************************************************************************/
 typedef struct pp_token {
    PP_TOKEN_TYPE theType;
-   CHAR theSource[MAX_PP_TOKEN_LENGTH+1];
-   TEXTPOS theTextPosition;
+   LPCSTR theSource;
+   int theLength;
    ULONG charOffset;
+   pp_atom theAtom;
 }pp_token;
 
+//Flags that change how a pp_lexer splits its input into tokens.  They're
+//all off after pp_lexer_Init.
+typedef enum PP_LEXER_FLAGS {
+   //return each run of spaces and tabs as a single PP_TOKEN_WHITESPACE
+   //instead of one token per character
+   PP_LEXER_COALESCE_WHITESPACE = 1,
+   //only tell apart what the preprocessor needs (identifiers, line breaks,
+   //'#', '\\' and character literals); everything else comes out in runs
+   //as PP_TOKEN_PASSTHROUGH tokens
+   PP_LEXER_COARSE = 2
+} PP_LEXER_FLAGS;
+
 /******************************************************************************
 *  CLexer -- This class is created with a string of unicode characters and a
 *  starting position, which it uses to create a series of CTokens based on the
@@ -74,26 +92,83 @@ typedef struct pp_token {
 ******************************************************************************/
 typedef struct pp_lexer {
     LPCSTR ptheSource;
-    TEXTPOS theTextPosition;
+    //One past the last character of the input
+    LPCSTR pend;
+    TEXTPOS theStartingPosition;
     ULONG offset;
+    //The current token runs from tokOffset up to (but not including) offset
     ULONG tokOffset;
     CHAR* pcurChar;
-    //Character buffer for the tokens
-    CHAR theTokenSource [MAX_PP_TOKEN_LENGTH];
-    TEXTPOS theTokenPosition;
+    unsigned int flags;
+    //If not NULL, identifiers are interned in this table
+    pp_intern_table* atoms;
+    //Where each line of the input starts, built by pp_lexer_GetPosition()
+    //the first time it's needed
+    uint32_t* lineStarts;
+    int lineCount;
+    int lastLine;
 } pp_lexer;
 
 
+/******************************************************************************
+*  pp_token_stream -- Every token of a buffer, as produced by pp_lexer_LexAll.
+*  The tokens are stored as parallel arrays so that iterating over them only
+*  touches the fields that are needed: element i of each array describes
+*  token i.  Offsets and lengths always describe the token's text in the
+*  input, even for newlines, which stand for "\n" however they're written.
+*  The stream refers to the input rather than copying it, so the input must
+*  outlive it.
+******************************************************************************/
+typedef struct pp_token_stream {
+   LPCSTR ptheSource;
+   uint8_t* types;
+   uint32_t* offsets;
+   uint32_t* lengths;
+   int count;
+   int capacity;
+} pp_token_stream;
+
+//Sets of characters that pp_lexer_Scan() stops at.  All of them include '\0',
+//and a scan also stops at the end it's given.
+typedef enum PP_SCAN_SET {
+   PP_SCAN_LINE_COMMENT = 1,  // line breaks that end a "//" comment
+   PP_SCAN_STAR_COMMENT = 2,  // '*' inside a "/* */" comment
+   PP_SCAN_STRING = 4         // '"' and '\\' inside a string literal
+} PP_SCAN_SET;
+
+//Implementations of pp_lexer_Scan(), from slowest to fastest.  It uses the
+//fastest one that the compiler and the CPU support.
+typedef enum PP_SCAN_LEVEL {
+   PP_SCAN_LEVEL_SCALAR,
+   PP_SCAN_LEVEL_SSE2,
+   PP_SCAN_LEVEL_AVX2
+} PP_SCAN_LEVEL;
+
 //Constructor
-void pp_token_Init(pp_token* ptoken, PP_TOKEN_TYPE theType, LPCSTR theSource, TEXTPOS theTextPosition, ULONG charOffset);
+void pp_token_Init(pp_token* ptoken, PP_TOKEN_TYPE theType, LPCSTR theSource, int theLength, ULONG charOffset);
+int pp_token_CopySource(const pp_token* ptoken, CHAR* buf, int bufsize);
+int pp_token_Equals(const pp_token* ptoken, LPCSTR str);
 void pp_lexer_Init(pp_lexer* plexer, LPCSTR theSource, TEXTPOS theStartingPosition);
+void pp_lexer_InitLength(pp_lexer* plexer, LPCSTR theSource, size_t theLength, TEXTPOS theStartingPosition);
 void pp_lexer_Clear(pp_lexer* plexer);
+HRESULT pp_lexer_GetPosition(pp_lexer* plexer, ULONG offset, TEXTPOS* pposition);
+int pp_lexer_GetLine(pp_lexer* plexer, ULONG offset);
 HRESULT pp_lexer_GetNextToken(pp_lexer* plexer, pp_token* theNextToken);
 HRESULT pp_lexer_GetTokenIdentifier(pp_lexer* plexer, pp_token* theNextToken);
+PP_TOKEN_TYPE pp_lexer_ClassifyIdentifier(LPCSTR theSource, int theLength);
 HRESULT pp_lexer_GetTokenNumber(pp_lexer* plexer, pp_token* theNextToken);
 HRESULT pp_lexer_GetTokenStringLiteral(pp_lexer* plexer, pp_token* theNextToken);
 HRESULT pp_lexer_GetTokenSymbol(pp_lexer* plexer, pp_token* theNextToken);
+HRESULT pp_lexer_GetTokenPassThrough(pp_lexer* plexer, pp_token* theNextToken);
 HRESULT pp_lexer_SkipComment(pp_lexer* lexer, COMMENT_TYPE theType);
+HRESULT pp_lexer_LexAll(pp_lexer* plexer, pp_token_stream* pstream);
+void pp_token_stream_Init(pp_token_stream* pstream);
+void pp_token_stream_Clear(pp_token_stream* pstream);
+void pp_token_stream_GetToken(const pp_token_stream* pstream, int index, pp_token* ptoken);
+LPCSTR pp_lexer_Scan(LPCSTR p, LPCSTR end, PP_SCAN_SET set);
+LPCSTR pp_lexer_ScanScalar(LPCSTR p, LPCSTR end, PP_SCAN_SET set);
+LPCSTR pp_lexer_ScanAt(PP_SCAN_LEVEL level, LPCSTR p, LPCSTR end, PP_SCAN_SET set);
+PP_SCAN_LEVEL pp_lexer_ScanLevel(void);
 
 #endif
 
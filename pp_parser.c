@@ -13,7 +13,6 @@
  * 
  * TODO/FIXME: lots of stuff with #define support
  * TODO: support conditional directives that require expression parsing (#if, #elif)
- * TODO: move the resizable buffer functionality into a separate class
  * 
  * @author Plombo
  * @date 15 October 2010
@@ -24,12 +23,12 @@
 #include <stdarg.h>
 #include <malloc.h>
 #include <errno.h>
-#include "List.h"
+#include <ctype.h>
 #include "pp_parser.h"
+#include "pp_buffer.h"
+#include "pp_arena.h"
 #include "borendian.h"
 
-#define DEFAULT_TOKEN_BUFFER_SIZE	(16 * 1024)
-#define TOKEN_BUFFER_SIZE_INCREMENT	(16 * 1024)
 #define skip_whitespace()			do { pp_lexer_GetNextToken(&self->lexer, &token); } while(token.theType == PP_TOKEN_WHITESPACE)
 
 #if PP_TEST // using pp_test.c to test the preprocessor functionality; OpenBOR functionality is not available
@@ -38,11 +37,16 @@
 #define tracecalloc(name, size)		calloc(1, size)
 #define tracerealloc(ptr, size, os)	realloc(ptr, size)
 #define tracefree(ptr)				free(ptr)
-#define openpackfile(fname, pname)	((int)fopen(fname, "rb"))
+#define openpackfile(fname, pname)	((intptr_t)fopen(fname, "rb"))
 #define readpackfile(hnd, buf, len)	fread(buf, 1, len, (FILE*)hnd)
 #define seekpackfile(hnd, loc, md)	fseek((FILE*)hnd, loc, md)
 #define tellpackfile(hnd)			ftell((FILE*)hnd)
 #define closepackfile(hnd)			fclose((FILE*)hnd)
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
 #define shutdown(ret, msg, args...) { fprintf(stderr, msg, ##args); exit(ret); }
 #else // otherwise, we can use OpenBOR functionality like tracemalloc and writeToLogFile
 #include "openbor.h"
@@ -53,18 +57,280 @@
 #endif
 
 /**
- * List of currently defined macros.  Macros don't die when parsers do (there's 
- * a separate parser for each #include and #define) so this list is defined globally.
+ * Identifiers are interned as they're lexed, and their atoms are the keys of 
+ * the macro table.  The intern table normally lives as long as the macros do, 
+ * but the host can ask for it to be kept across pp_parser_reset() calls so 
+ * that the identifiers of one script are already interned for the next.
  */
-List macros = {NULL, NULL, NULL, NULL, 0, 0};
+static pp_intern_table atoms = {{NULL, 0, 0}, NULL, 0, 0, NULL, 0};
+static bool retain_atoms = false;
 
 /**
- * The token buffer.  Like the macro list, it is defined globally because it 
- * doesn't die when parsers do.  It is realloc()ed if it needs to be enlarged.
+ * The contents of included files, so that a file included by many scripts is 
+ * only read once.  Files are found by the atom of their path in a table of 
+ * their own.  The cache isn't cleared by pp_parser_reset(); it lives until the 
+ * host calls pp_parser_flush_includes(), e.g. when the mod's files change.
+ * 
+ * A file's identity tells whether two paths lead to the same file, for 
+ * "#pragma once".  On the file system, it's the file's device and inode; in 
+ * a packfile, there's no such thing, so it's the length and a hash of the 
+ * contents.
+ * 
+ * On the file system, files are mapped into memory instead of read, so an 
+ * included file costs no copy and no heap.  The lexer is told where the 
+ * contents end, so they don't need a NUL terminator.
+ */
+typedef struct pp_file_id {
+	uint64_t device; // or the length of the contents, with the top bit set
+	uint64_t inode;  // or the hash of the contents
+} pp_file_id;
+
+typedef struct pp_include_file {
+	char* contents; // not NUL-terminated; NULL if the file hasn't been read
+	int length;
+	bool mapped;    // the contents are mapped rather than allocated
+	pp_atom guard;  // the name of the file's include guard in includes.guards, or 0
+	bool identified;
+	pp_file_id id;
+	unsigned int once; // the generation in which the file was marked "#pragma once"
+} pp_include_file;
+
+static struct {
+	pp_intern_table paths;
+	pp_intern_table guards;  // the names of include guards, kept apart from the paths
+	pp_include_file* byAtom;
+	pp_atom capacity;
+	pp_include_stats stats;
+	unsigned int generation; // changes with every pp_parser_reset()
+} includes = {{{NULL, 0, 0}, NULL, 0, 0, NULL, 0}, {{NULL, 0, 0}, NULL, 0, 0, NULL, 0}, NULL, 0, {0, 0, 0, 0}, 1};
+
+/**
+ * The identities of the files marked "#pragma once" by the current script, in 
+ * an open-addressing hash table, so that files included under other paths are 
+ * recognized too.
+ */
+static struct {
+	pp_file_id* slots;
+	bool* used;
+	int count;
+	int capacity; // always a power of 2
+} once_files = {NULL, NULL, 0, 0};
+
+/**
+ * Table of currently defined macros.  Macros don't die when parsers do (there's 
+ * a separate parser for each #include and #define) so this table is defined 
+ * globally.  It's indexed by the atom of the macro's name, so finding out 
+ * whether an identifier is a macro is a single array access.
+ * 
+ * A macro's contents are lexed once, when it's defined, and expanding it 
+ * replays the tokens.  Their text refers to the contents.  The contents and 
+ * tokens are allocated from macro_arena.  For function-like 
+ * macros, paramIndex gives the parameter each token refers to, or -1 for 
+ * tokens that aren't parameters.  If the contents use the '#' or '##' 
+ * operators, the operators are taken out of the tokens and "ops" gives the 
+ * MACRO_OP flags of each token instead; otherwise it's NULL.
+ * 
+ * The full expansion of an object-like macro is memoized the second time it's 
+ * expanded, unless it's unstable: it depends on the tokens that follow the 
+ * reference (e.g. it ends with the name of a function-like macro).
+ * 
+ * A macro is "expanding" while its expansion is on the context stack, and 
+ * isn't expanded again until it's done, so recursive macros terminate.
+ */
+typedef struct pp_memo pp_memo;
+
+typedef struct pp_macro {
+	bool defined;
+	bool functionLike;
+	bool variadic; // the last parameter is __VA_ARGS__
+	bool unstable;
+	bool expanding;
+	int paramCount;
+	char* contents;
+	pp_token* tokens;
+	int* paramIndex;
+	unsigned char* ops;
+	int tokenCount;
+	int uses;
+	pp_memo* memo;
+} pp_macro;
+
+static struct {
+	pp_macro* byAtom;
+	pp_atom capacity;
+} macros = {NULL, 0};
+
+enum {
+	MACRO_OP_STRINGIZE = 1, // '#': the parameter's argument becomes a string literal
+	MACRO_OP_PASTE = 2,     // '##': the token is pasted onto the one before it
+	MACRO_OP_RAW = 4        // the parameter's argument isn't macro-expanded first
+};
+
+/**
+ * Where the contents and tokens of macros are stored.  They're only freed, all 
+ * at once, by pp_parser_reset(); the space used by a macro that's redefined or 
+ * undefined stays allocated until then.
+ */
+static pp_arena macro_arena = {NULL, NULL, NULL};
+
+/**
+ * Where the text of the tokens made by '#' and '##' is stored.  It's cleared 
+ * once the output that refers to it has been written.
+ */
+static pp_arena paste_arena = {NULL, NULL, NULL};
+
+/**
+ * The line of the directive being parsed.
+ */
+static pp_buffer directive_line = {NULL, 0, 0};
+
+/**
+ * The memoized expansion of an object-like macro: the tokens it expands to, 
+ * whose text is stored contiguously so that a reference can be emitted as a 
+ * single span, and every name that was looked up while expanding it.  It's 
+ * allocated as one block, and freed as soon as one of those names is defined 
+ * or undefined.
+ */
+struct pp_memo {
+	pp_token* tokens;
+	int tokenCount;
+	pp_atom* deps;
+	int depCount;
+	char* text;
+	int textLength;
+};
+
+/**
+ * For each atom, the macros whose expansions have been memoized (or found to 
+ * be unstable) while it was looked up, so that they can be forgotten when it's 
+ * defined or undefined.  Entries can be stale, which only costs a redundant 
+ * invalidation.  "mark" tells whether the atom has already been seen while a 
+ * memo is being built.
+ */
+typedef struct pp_dependents {
+	pp_atom* atoms;
+	int count;
+	int capacity;
+	unsigned int mark;
+} pp_dependents;
+
+static struct {
+	pp_dependents* byAtom;
+	pp_atom capacity;
+	unsigned int mark;
+} dependents = {NULL, 0, 0};
+
+/**
+ * Expansions being recorded to be memoized.  While there are any, emitted 
+ * tokens are also pushed onto "tokens" and the names that are looked up onto 
+ * "deps".  Recordings nest, so each one only remembers where its part of 
+ * those stacks starts, and they're emptied when the outermost one ends.
+ */
+typedef struct pp_capture {
+	pp_atom atom;
+	int tokenStart;
+	int depStart;
+	bool unstable;
+} pp_capture;
+
+static struct {
+	pp_capture* captures;
+	int count;
+	int capacity;
+	pp_token* tokens;
+	int tokenCount;
+	int tokenCapacity;
+	pp_atom* deps;
+	int depCount;
+	int depCapacity;
+} recording = {NULL, 0, 0, NULL, 0, 0, NULL, 0, 0};
+
+/**
+ * Scratch space for macros: a stack of tokens and a stack of the arguments 
+ * (ranges of the token stack) of the function-like macros being expanded. 
+ * Each expansion pushes what it needs and pops it when it's done, and macro 
+ * contents are lexed here before they're copied to the macro, so once the 
+ * stacks are big enough, expanding a macro doesn't allocate anything.
+ */
+typedef struct pp_macro_arg {
+	int start;
+	int end;
+	int expandedStart; // -1 until the argument has been macro-expanded
+	int expandedEnd;
+} pp_macro_arg;
+
+static struct {
+	pp_token* tokens;
+	int tokenCount;
+	int tokenCapacity;
+	pp_macro_arg* args;
+	int argCount;
+	int argCapacity;
+} scratch = {NULL, 0, 0, NULL, 0, 0};
+
+/**
+ * The context stack: the expansions in progress, innermost on top.  Each one 
+ * is the range of a token array that's left to be scanned, which is either a 
+ * macro's tokens or its substituted contents on the scratch stack (so the array 
+ * is given by the address of its pointer, since the scratch stack moves when 
+ * it grows).  Below the bottom context is the parser's lexer.
+ * 
+ * When a context is popped, its macro can be expanded again, the scratch 
+ * stacks are popped back to where they were when it was pushed, and the line 
+ * breaks its arguments contained are emitted.  If its expansion is being 
+ * recorded, "capture" is the recording's index, otherwise -1.
+ * 
+ * A context can also be a macro argument that's expanded on its own before 
+ * it's substituted, in which case "macro" is 0 and the scan stops at its end; 
+ * the tokens it expands to are collected on the prescan stack.
  */
+typedef struct pp_context {
+	pp_token** tokens;
+	int position;
+	int end;
+	pp_atom macro;
+	bool argument;
+	int capture;
+	int tokenBase;
+	int argBase;
+	int newlines;
+} pp_context;
+
+static struct {
+	pp_context* stack;
+	int count;
+	int capacity;
+} contexts = {NULL, 0, 0};
+
+static struct {
+	pp_token* tokens;
+	int count;
+	int capacity;
+	int depth; // the number of arguments being expanded
+} prescan = {NULL, 0, 0, 0};
+
+/**
+ * The token buffer, which is what the default output sink writes to.  Like the 
+ * macro list, it is defined globally because it doesn't die when parsers do. 
+ * "tokens" is its NUL-terminated contents, which move whenever the buffer is 
+ * enlarged.
+ */
+static pp_buffer output = {NULL, 0, 0};
 char* tokens = NULL;
-static int token_bufsize = 0;
-static int tokens_length = 0;
+
+/**
+ * Emitted tokens don't go to the output sink right away.  They are collected 
+ * as spans of the text they came from, which merge as long as the tokens are 
+ * adjacent, and written out when there are MAX_PENDING_SPANS of them, when the 
+ * script is done, or when the text they refer to is about to be freed.
+ */
+#define MAX_PENDING_SPANS 1024
+static pp_rope output_spans = {NULL, 0, 0, 0};
+
+/**
+ * How many parsers are running; the outermost one flushes the output when it's done.
+ */
+static int parse_depth = 0;
 
 /**
  * Stack of conditional directives.  The preprocessor can handle up to 16 nested 
@@ -88,63 +354,547 @@ enum conditional_state {
 };
 
 /**
- * Emits a token to the token buffer, enlarging the token buffer if necessary. 
- * (Too bad strlcat() isn't part of the C standard library, or even in glibc.)
- * \pre token buffer is non-NULL
- * @param token the pp_token to emit
+ * @return true if the current conditional block evaluates to false, so 
+ *         nothing in it should be emitted
+ */
+static __inline__ bool skipping()
+{
+	return conditionals.top == cs_false || conditionals.top == cs_done;
+}
+
+/**
+ * Makes sure the token buffer can hold at least the given number of characters, 
+ * shutting down if it can't be enlarged.
+ */
+static void reserve_output(size_t length)
+{
+	if(!pp_buffer_reserve(&output, length))
+	{
+		// tracerealloc() failed...
+		shutdown(1, "Fatal error: tracerealloc() failed. The system might "
+			   "be out of memory, or it may have a shoddy realloc() "
+			   "implementation.\n");
+	}
+	tokens = output.data;
+}
+
+/**
+ * The default output sink, which appends the preprocessed script to "tokens".
+ */
+static bool buffer_sink_write(pp_sink* sink, const char* text, size_t length)
+{
+	(void)sink; // there's only one token buffer
+	if(output.length + length >= output.capacity)
+		reserve_output(output.length + length);
+	return pp_buffer_append(&output, text, length);
+}
+
+static pp_sink buffer_sink = {buffer_sink_write, NULL, NULL};
+
+/**
+ * Writes the pending output spans to the parser's sink.
+ */
+static void flush_output(pp_parser* self)
+{
+	int i;
+	
+	if(self->sink->write == NULL) return;
+	for(i=0; i<output_spans.count; i++)
+	{
+		if(!self->sink->write(self->sink, output_spans.spans[i].text, output_spans.spans[i].length))
+			pp_error(self, "unable to write the preprocessed script");
+	}
+	output_spans.count = 0;
+	output_spans.length = 0;
+	if(contexts.count == 0)
+		pp_arena_clear(&paste_arena);
+}
+
+/**
+ * Makes sure an array has room for one more element, doubling its capacity if 
+ * it's full.
+ * @param array the address of the array's pointer
+ * @param size the size of an element
  */
-static __inline__ void emit(pp_token token)
+static void reserve_one(pp_parser* self, void** array, int count, int* capacity, size_t size)
 {
-	int toklen = strlen(token.theSource);
+	int newCapacity = *capacity ? *capacity * 2 : 64;
+	void* grown;
 	
+	if(count < *capacity) return;
+	grown = tracerealloc(*array, newCapacity * size, *capacity * size);
+	if(grown == NULL) pp_error(self, "out of memory expanding macro");
+	*array = grown;
+	*capacity = newCapacity;
+}
+
+/**
+ * Adds a token to the expansions being recorded.
+ */
+static void record_token(pp_parser* self, const pp_token* token)
+{
+	reserve_one(self, (void**)&recording.tokens, recording.tokenCount, &recording.tokenCapacity, sizeof(pp_token));
+	recording.tokens[recording.tokenCount++] = *token;
+}
+
+/**
+ * Adds a name that was looked up to the expansions being recorded.
+ */
+static void record_dep(pp_parser* self, pp_atom atom)
+{
+	reserve_one(self, (void**)&recording.deps, recording.depCount, &recording.depCapacity, sizeof(pp_atom));
+	recording.deps[recording.depCount++] = atom;
+}
+
+/**
+ * @return the line a token of the output belongs to
+ */
+static int token_line(pp_parser* self, pp_token* token)
+{
+	return self->macroLine >= 0 ? self->macroLine : pp_lexer_GetLine(&self->lexer, token->charOffset);
+}
+
+/**
+ * Emits a token to the output.  The token's text must stay valid until the 
+ * output is flushed.
+ * @param token the pp_token to emit
+ */
+static __inline__ void emit(pp_parser* self, pp_token* token)
+{
 	// don't emit anything if the current conditional block evaluates to false
-	if(conditionals.top == cs_false || conditionals.top == cs_done)
+	if(skipping())
+		return;
+	
+	if(recording.count)
+		record_token(self, token);
+	if(self->sink->token && !self->sink->token(self->sink, token, self->filename, token_line(self, token)))
+		pp_error(self, "unable to write the preprocessed script");
+	if(self->sink->write == NULL)
+		return;
+	
+	if(output_spans.count == MAX_PENDING_SPANS)
+		flush_output(self);
+	if(!pp_rope_append(&output_spans, token->theSource, token->theLength))
+		shutdown(1, "Fatal error: tracerealloc() failed. The system might be out of memory.\n");
+}
+
+/**
+ * Emits the memoized expansion of a macro.
+ */
+static void emit_memo(pp_parser* self, pp_memo* memo)
+{
+	int i;
+	
+	// an enclosing recording gets the tokens, and depends on whatever this one does
+	for(i=0; recording.count && i<memo->tokenCount; i++)
+		record_token(self, &memo->tokens[i]);
+	for(i=0; recording.count && i<memo->depCount; i++)
+		record_dep(self, memo->deps[i]);
+	
+	for(i=0; self->sink->token && i<memo->tokenCount; i++)
+	{
+		if(!self->sink->token(self->sink, &memo->tokens[i], self->filename, token_line(self, &memo->tokens[i])))
+			pp_error(self, "unable to write the preprocessed script");
+	}
+	if(self->sink->write == NULL || memo->textLength == 0)
 		return;
 	
-	if(toklen + tokens_length >= token_bufsize)
+	if(output_spans.count == MAX_PENDING_SPANS)
+		flush_output(self);
+	if(!pp_rope_append(&output_spans, memo->text, memo->textLength))
+		shutdown(1, "Fatal error: tracerealloc() failed. The system might be out of memory.\n");
+}
+
+/**
+ * Finds the macro with the same name as a token.
+ * @return the macro, or NULL if it isn't defined
+ */
+static __inline__ pp_macro* find_macro(pp_token* token)
+{
+	pp_macro* macro;
+	
+	// atom 0 (not an identifier) is never defined
+	if(token->theAtom >= macros.capacity) return NULL;
+	macro = &macros.byAtom[token->theAtom];
+	return macro->defined ? macro : NULL;
+}
+
+/**
+ * Pushes a token onto the scratch stack.
+ */
+static __inline__ void push_token(pp_parser* self, const pp_token* token)
+{
+	if(scratch.tokenCount == scratch.tokenCapacity)
+		reserve_one(self, (void**)&scratch.tokens, scratch.tokenCount, &scratch.tokenCapacity, sizeof(pp_token));
+	scratch.tokens[scratch.tokenCount++] = *token;
+}
+
+/**
+ * Starts a new macro argument at the top of the token stack.
+ */
+static void push_arg(pp_parser* self)
+{
+	reserve_one(self, (void**)&scratch.args, scratch.argCount, &scratch.argCapacity, sizeof(pp_macro_arg));
+	scratch.args[scratch.argCount].start = scratch.args[scratch.argCount].end = scratch.tokenCount;
+	scratch.args[scratch.argCount].expandedStart = -1;
+	scratch.argCount++;
+}
+
+/**
+ * @return the index of the parameter a token of a macro's contents refers 
+ *         to, or -1 if it isn't a parameter
+ */
+static int param_index(pp_macro* macro, pp_token* token, pp_atom* params)
+{
+	int i;
+	
+	for(i=0; token->theAtom && i<macro->paramCount; i++)
+		if(token->theAtom == params[i]) return i;
+	return -1;
+}
+
+/**
+ * Takes the '#' and '##' operators out of the lexed contents of a macro on 
+ * the token stack, and sets the flags of their operands in the macro's ops.  
+ * '#' is only an operator in function-like macros, where it must be followed 
+ * by a parameter.  Whitespace around '##' doesn't matter, so it's dropped.
+ */
+static void parse_operators(pp_parser* self, pp_macro* macro, pp_atom* params)
+{
+	pp_token* tokens = scratch.tokens;
+	int count = 0, i;
+	bool paste = false;
+	
+	if((macro->ops = pp_arena_alloc(&macro_arena, scratch.tokenCount)) == NULL)
+		pp_error(self, "out of memory defining macro");
+	for(i=0; i<scratch.tokenCount; i++)
 	{
-		int new_bufsize = token_bufsize + TOKEN_BUFFER_SIZE_INCREMENT;
-		char* tokens2;
-		tokens2 = tracerealloc(tokens, new_bufsize, token_bufsize);
-		if(tokens2)
+		pp_token token = tokens[i];
+		unsigned char op = 0;
+		
+		if(token.theType == PP_TOKEN_DIRECTIVE && i + 1 < scratch.tokenCount &&
+		   tokens[i + 1].theType == PP_TOKEN_DIRECTIVE && tokens[i + 1].theSource == token.theSource + 1)
 		{
-			tokens = tokens2;
-			memset(tokens + token_bufsize, 0, new_bufsize - token_bufsize);
-			token_bufsize = new_bufsize;
+			while(count > 0 && tokens[count - 1].theType == PP_TOKEN_WHITESPACE) count--;
+			if(count == 0 || paste)
+				pp_error(self, "'##' cannot appear at either end of a macro expansion");
+			paste = true;
+			i++;
+			continue;
 		}
-		else
+		if(token.theType == PP_TOKEN_WHITESPACE && paste)
+			continue;
+		if(token.theType == PP_TOKEN_DIRECTIVE && macro->functionLike)
+		{
+			while(++i < scratch.tokenCount && tokens[i].theType == PP_TOKEN_WHITESPACE);
+			if(i == scratch.tokenCount || param_index(macro, &tokens[i], params) < 0)
+				pp_error(self, "'#' is not followed by a macro parameter");
+			token = tokens[i];
+			op = MACRO_OP_STRINGIZE;
+		}
+		if(paste) op |= MACRO_OP_PASTE;
+		paste = false;
+		
+		tokens[count] = token;
+		macro->ops[count++] = op;
+	}
+	if(paste)
+		pp_error(self, "'##' cannot appear at either end of a macro expansion");
+	scratch.tokenCount = count;
+}
+
+/**
+ * Lexes the contents of a macro into its tokens, and for a function-like 
+ * macro, finds the parameters among them.
+ * @param params the atoms of the macro's parameters
+ */
+static void tokenize_macro(pp_parser* self, pp_macro* macro, pp_atom* params)
+{
+	TEXTPOS initialPos = {0, 0};
+	pp_lexer lexer;
+	pp_token token;
+	int i;
+	
+	// macros are lexed in full, so they can be expanded for any sink
+	pp_lexer_Init(&lexer, macro->contents, initialPos);
+	lexer.atoms = &atoms;
+	lexer.flags = PP_LEXER_COALESCE_WHITESPACE;
+	while(1)
+	{
+		if(FAILED(pp_lexer_GetNextToken(&lexer, &token)))
+			pp_error(self, "unable to parse macro contents '%s'", macro->contents);
+		if(token.theType == PP_TOKEN_EOF) break;
+		push_token(self, &token);
+	}
+	
+	macro->tokens = NULL;
+	macro->paramIndex = NULL;
+	macro->ops = NULL;
+	for(i=0; i<scratch.tokenCount; i++)
+	{
+		if(scratch.tokens[i].theType == PP_TOKEN_DIRECTIVE)
+		{
+			parse_operators(self, macro, params);
+			break;
+		}
+	}
+	macro->tokenCount = scratch.tokenCount;
+	if(macro->tokenCount == 0) return;
+	
+	if((macro->tokens = pp_arena_alloc(&macro_arena, macro->tokenCount * sizeof(pp_token))) == NULL ||
+	   (macro->functionLike && (macro->paramIndex = pp_arena_alloc(&macro_arena, macro->tokenCount * sizeof(int))) == NULL))
+		pp_error(self, "out of memory defining macro");
+	memcpy(macro->tokens, scratch.tokens, macro->tokenCount * sizeof(pp_token));
+	scratch.tokenCount = 0;
+	
+	for(i=0; macro->paramIndex && i<macro->tokenCount; i++)
+	{
+		macro->paramIndex[i] = param_index(macro, &macro->tokens[i], params);
+		
+		// the operands of '##' are pasted as they are
+		if(macro->paramIndex[i] >= 0 && macro->ops && ((macro->ops[i] & MACRO_OP_PASTE) || 
+		   (i + 1 < macro->tokenCount && (macro->ops[i + 1] & MACRO_OP_PASTE))))
+			macro->ops[i] |= MACRO_OP_RAW;
+	}
+}
+
+/**
+ * Frees a macro's memoized expansion and forgets its contents and tokens, 
+ * which stay in the arena.
+ */
+static void free_macro(pp_macro* macro)
+{
+	if(macro->memo) tracefree(macro->memo);
+	macro->contents = NULL;
+	macro->tokens = NULL;
+	macro->paramIndex = NULL;
+	macro->memo = NULL;
+	macro->tokenCount = 0;
+}
+
+/**
+ * Registers a macro as depending on a name.
+ */
+static void add_dependent(pp_parser* self, pp_atom atom, pp_atom macro)
+{
+	pp_dependents* list;
+	
+	if(atom >= dependents.capacity)
+	{
+		pp_atom capacity = dependents.capacity ? dependents.capacity : 256;
+		pp_dependents* byAtom;
+		
+		while(capacity <= atom) capacity *= 2;
+		byAtom = tracerealloc(dependents.byAtom, capacity * sizeof(pp_dependents), dependents.capacity * sizeof(pp_dependents));
+		if(byAtom == NULL) pp_error(self, "out of memory expanding macro");
+		memset(byAtom + dependents.capacity, 0, (capacity - dependents.capacity) * sizeof(pp_dependents));
+		dependents.byAtom = byAtom;
+		dependents.capacity = capacity;
+	}
+	
+	list = &dependents.byAtom[atom];
+	if(list->count && list->atoms[list->count - 1] == macro) return;
+	reserve_one(self, (void**)&list->atoms, list->count, &list->capacity, sizeof(pp_atom));
+	list->atoms[list->count++] = macro;
+}
+
+/**
+ * Forgets the memoized expansions that depend on a name, which is about to be 
+ * defined or undefined.
+ */
+static void invalidate_dependents(pp_parser* self, pp_atom atom)
+{
+	pp_dependents* list;
+	int i;
+	
+	if(atom >= dependents.capacity) return;
+	list = &dependents.byAtom[atom];
+	for(i=0; i<list->count; i++)
+	{
+		pp_macro* macro = &macros.byAtom[list->atoms[i]];
+		if(macro->memo)
+		{
+			// the memo may still be referenced by pending output
+			flush_output(self);
+			tracefree(macro->memo);
+			macro->memo = NULL;
+		}
+		macro->unstable = false;
+	}
+	list->count = 0;
+}
+
+/**
+ * Starts recording the expansion of a macro.
+ * @return the index of the recording
+ */
+static int begin_capture(pp_parser* self, pp_atom atom)
+{
+	pp_capture* capture;
+	
+	reserve_one(self, (void**)&recording.captures, recording.count, &recording.capacity, sizeof(pp_capture));
+	capture = &recording.captures[recording.count];
+	capture->atom = atom;
+	capture->tokenStart = recording.tokenCount;
+	capture->depStart = recording.depCount;
+	capture->unstable = false;
+	return recording.count++;
+}
+
+/**
+ * Finishes the innermost recording, and memoizes the expansion unless it 
+ * turned out to be unstable.
+ */
+static void end_capture(pp_parser* self)
+{
+	pp_capture* capture = &recording.captures[--recording.count];
+	pp_macro* macro = &macros.byAtom[capture->atom];
+	int tokenCount = recording.tokenCount - capture->tokenStart;
+	int maxDeps = recording.depCount - capture->depStart;
+	int textLength = 0, i;
+	pp_memo* memo = NULL;
+	char* text;
+	
+	for(i=capture->tokenStart; i<recording.tokenCount; i++)
+		textLength += recording.tokens[i].theLength;
+	
+	// the memo is laid out as the header, the tokens, the names and the text
+	if(capture->unstable)
+		macro->unstable = true;
+	else if((memo = tracemalloc("pp_memo", sizeof(pp_memo) + tokenCount * sizeof(pp_token) + 
+	                            maxDeps * sizeof(pp_atom) + textLength)) == NULL)
+		pp_error(self, "out of memory expanding macro");
+	
+	// register the macro with each name it depends on, once
+	dependents.mark++;
+	if(memo)
+	{
+		memo->deps = (pp_atom*)((pp_token*)(memo + 1) + tokenCount);
+		memo->depCount = 0;
+	}
+	for(i=capture->depStart; i<recording.depCount; i++)
+	{
+		pp_atom atom = recording.deps[i];
+		add_dependent(self, atom, capture->atom);
+		if(dependents.byAtom[atom].mark == dependents.mark) continue;
+		dependents.byAtom[atom].mark = dependents.mark;
+		if(memo) memo->deps[memo->depCount++] = atom;
+	}
+	
+	if(memo)
+	{
+		memo->tokens = (pp_token*)(memo + 1);
+		memo->tokenCount = tokenCount;
+		memo->text = text = (char*)(memo->deps + maxDeps);
+		memo->textLength = textLength;
+		for(i=0; i<tokenCount; i++)
 		{
-			// tracerealloc() failed...
-			shutdown(1, "Fatal error: tracerealloc() failed. The system might "
-				   "be out of memory, or it may have a shoddy realloc() "
-				   "implementation.\n");
+			memo->tokens[i] = recording.tokens[capture->tokenStart + i];
+			memcpy(text, memo->tokens[i].theSource, memo->tokens[i].theLength);
+			memo->tokens[i].theSource = text;
+			text += memo->tokens[i].theLength;
 		}
+		macro->memo = memo;
+	}
+	
+	if(recording.count == 0)
+		recording.tokenCount = recording.depCount = 0;
+}
+
+/**
+ * Defines a macro, replacing any previous definition of the same name.
+ * @param name the macro's name, which must be an identifier
+ * @param definition the new definition; its contents must have been allocated 
+ *        from macro_arena
+ * @param params the atoms of the parameters of a function-like macro
+ */
+static void define_macro(pp_parser* self, pp_token* name, pp_macro* definition, pp_atom* params)
+{
+	pp_macro* macro;
+	
+	tokenize_macro(self, definition, params);
+	invalidate_dependents(self, name->theAtom);
+	if(name->theAtom >= macros.capacity)
+	{
+		pp_atom capacity = macros.capacity ? macros.capacity : 256;
+		pp_macro* byAtom;
+		
+		while(capacity <= name->theAtom) capacity *= 2;
+		byAtom = tracerealloc(macros.byAtom, capacity * sizeof(pp_macro), macros.capacity * sizeof(pp_macro));
+		if(byAtom == NULL)
+			pp_error(self, "out of memory defining macro '%.*s'", name->theLength, name->theSource);
+		memset(byAtom + macros.capacity, 0, (capacity - macros.capacity) * sizeof(pp_macro));
+		macros.byAtom = byAtom;
+		macros.capacity = capacity;
+	}
+	
+	macro = &macros.byAtom[name->theAtom];
+	if(macro->defined)
+	{
+		// the old contents may still be referenced by pending output
+		flush_output(self);
+		free_macro(macro);
 	}
+	*macro = *definition;
+	macro->defined = true;
+}
+
+/**
+ * Undefines a macro.
+ * @param name the macro's name
+ */
+static void undefine_macro(pp_parser* self, pp_token* name)
+{
+	pp_macro* macro = find_macro(name);
+	
+	if(macro == NULL) return;
+	invalidate_dependents(self, name->theAtom);
 	
-	strncat(tokens, token.theSource, toklen);
-	tokens_length += toklen;
+	// the contents may still be referenced by pending output
+	flush_output(self);
+	free_macro(macro);
+	macro->defined = false;
 }
 
 /**
  * Initializes a preprocessor parser (pp_parser) object.
  * @param self the object
  * @param script the script to write the processed script file to
+ * @param sink where to write the preprocessed script, or NULL for the global 
+ *        token buffer ("tokens")
  */
-void pp_parser_init(pp_parser* self, Script* script, char* filename, char* sourceCode)
+void pp_parser_init(pp_parser* self, Script* script, char* filename, char* sourceCode, pp_sink* sink)
+{
+	pp_parser_init_length(self, script, filename, sourceCode, strlen(sourceCode), sink);
+}
+
+/**
+ * Like pp_parser_init(), but for source code that isn't NUL-terminated.
+ * @param length the length of the source code
+ */
+void pp_parser_init_length(pp_parser* self, Script* script, char* filename, char* sourceCode, 
+                           size_t length, pp_sink* sink)
 {
 	TEXTPOS initialPos = {0, 0};
-	pp_lexer_Init(&self->lexer, sourceCode, initialPos);
 	self->script = script;
 	self->filename = filename;
 	self->sourceCode = sourceCode;
+	self->sink = sink ? sink : &buffer_sink;
+	self->macroLine = -1;
+	self->guardState = PP_GUARD_START;
+	self->guard = 0;
+	self->once = false;
 	
-	// allocate token buffer with default size of 4 KB; expand it later if needed
-	if(tokens == NULL)
-	{
-		tokens = tracecalloc("pp_parser tokens", DEFAULT_TOKEN_BUFFER_SIZE);
-		token_bufsize = DEFAULT_TOKEN_BUFFER_SIZE;
-		tokens_length = 0;
-	}
+	// coarse lexing is enough unless the sink wants the tokens themselves
+	pp_lexer_InitLength(&self->lexer, sourceCode, length, initialPos);
+	self->lexer.atoms = &atoms;
+	self->lexer.flags = PP_LEXER_COALESCE_WHITESPACE;
+	if(self->sink->token == NULL) self->lexer.flags |= PP_LEXER_COARSE;
+	
+	// allocate the token buffer; the output is usually about as long as the 
+	// script, so start with room for that and expand it later if needed
+	if(self->sink == &buffer_sink && tokens == NULL)
+		reserve_output(length);
 }
 
 /**
@@ -154,359 +904,1453 @@ void pp_parser_init(pp_parser* self, Script* script, char* filename, char* sourc
 void pp_parser_reset()
 {
 	// undefine and free all macros
-	List_Reset(&macros);
-	while(macros.size > 0)
+	pp_atom i;
+	for(i=0; i<macros.capacity; i++)
 	{
-		tracefree(List_Retrieve(&macros));
-		List_Remove(&macros);
+		if(macros.byAtom[i].defined)
+			free_macro(&macros.byAtom[i]);
 	}
+	if(macros.byAtom) tracefree(macros.byAtom);
+	macros.byAtom = NULL;
+	macros.capacity = 0;
+	pp_arena_clear(&macro_arena);
+	pp_arena_clear(&paste_arena);
+	
+	// every script gets its own set of files marked "#pragma once"
+	if(once_files.slots) tracefree(once_files.slots);
+	if(once_files.used) tracefree(once_files.used);
+	memset(&once_files, 0, sizeof(once_files));
+	includes.generation++;
+	pp_buffer_clear(&directive_line);
+	if(scratch.tokens) tracefree(scratch.tokens);
+	if(scratch.args) tracefree(scratch.args);
+	memset(&scratch, 0, sizeof(scratch));
+	
+	// forget what the memoized expansions depended on
+	for(i=0; i<dependents.capacity; i++)
+	{
+		if(dependents.byAtom[i].atoms)
+			tracefree(dependents.byAtom[i].atoms);
+	}
+	if(dependents.byAtom) tracefree(dependents.byAtom);
+	memset(&dependents, 0, sizeof(dependents));
+	if(recording.captures) tracefree(recording.captures);
+	if(recording.tokens) tracefree(recording.tokens);
+	if(recording.deps) tracefree(recording.deps);
+	memset(&recording, 0, sizeof(recording));
+	if(contexts.stack) tracefree(contexts.stack);
+	memset(&contexts, 0, sizeof(contexts));
+	if(prescan.tokens) tracefree(prescan.tokens);
+	memset(&prescan, 0, sizeof(prescan));
+	
+	// forget the atoms too, unless the host wants them kept
+	if(!retain_atoms)
+		pp_intern_clear(&atoms);
+	
+	// free the token buffer
+	pp_rope_clear(&output_spans);
+	pp_buffer_clear(&output);
+	tokens = NULL;
+	parse_depth = 0;
+	
+	// reset the conditional state
+	conditionals.all = 0;
+}
+
+/**
+ * Sets whether pp_parser_reset() keeps the table of interned identifiers.  
+ * Keeping it saves interning the same identifiers again for every script, at 
+ * the cost of holding on to every identifier seen until it's turned off again 
+ * and the parser is reset.
+ */
+void pp_parser_retain_atoms(bool retain)
+{
+	retain_atoms = retain;
+}
+
+/**
+ * Frees the contents of every included file that's cached, so that they're 
+ * read again the next time they're included, and resets the statistics.
+ */
+void pp_parser_flush_includes()
+{
+	pp_atom i;
+	
+	for(i=0; i<includes.capacity; i++)
+	{
+		pp_include_file* file = &includes.byAtom[i];
+		if(file->contents == NULL) continue;
+#if PP_TEST
+		if(file->mapped)
+		{
+			if(file->length) munmap(file->contents, file->length);
+		}
+		else
+#endif
+			tracefree(file->contents);
+	}
+	if(includes.byAtom) tracefree(includes.byAtom);
+	includes.byAtom = NULL;
+	includes.capacity = 0;
+	pp_intern_clear(&includes.paths);
+	pp_intern_clear(&includes.guards);
+	memset(&includes.stats, 0, sizeof(includes.stats));
+}
+
+/**
+ * @return how well the include cache has done since it was last flushed
+ */
+pp_include_stats pp_parser_include_stats()
+{
+	return includes.stats;
+}
+
+/**
+ * Formats a message into a buffer, or into newly allocated memory if it's too 
+ * long for the buffer (such as the text of a long #warning).
+ * @return the message; if it's not "buf", the caller must free it
+ */
+static char* format_message(char* buf, size_t size, char* format, va_list arglist)
+{
+	va_list copy;
+	char* message;
+	int length;
+	
+	va_copy(copy, arglist);
+	length = vsnprintf(buf, size, format, copy);
+	va_end(copy);
+	if(length < (int)size || (message = tracemalloc("pp_message", length + 1)) == NULL)
+		return buf; // truncated if it's too long and there's no memory
+	vsnprintf(message, length + 1, format, arglist);
+	return message;
+}
+
+/**
+ * Exits the preprocessor with an error message.
+ */
+void pp_error(pp_parser* self, char* format, ...)
+{
+	char buf[1024] = {""};
+	char* message;
+	TEXTPOS position = {0, 0};
+	va_list arglist;
+	
+	va_start(arglist, format);
+	message = format_message(buf, sizeof(buf), format, arglist);
+	va_end(arglist);
+	pp_lexer_GetPosition(&self->lexer, self->lexer.tokOffset, &position);
+	shutdown(1, "Preprocessor error: %s: line %d: %s\n", self->filename, position.row + 1, message);
+}
+
+/**
+ * Writes a warning message to the log.
+ */
+void pp_warning(pp_parser* self, char* format, ...)
+{
+	char buf[1024] = {""};
+	char* message;
+	TEXTPOS position = {0, 0};
+	va_list arglist;
+	
+	va_start(arglist, format);
+	message = format_message(buf, sizeof(buf), format, arglist);
+	va_end(arglist);
+	pp_lexer_GetPosition(&self->lexer, self->lexer.tokOffset, &position);
+	printf("Preprocessor warning: %s: line %d: %s\n", self->filename, position.row + 1, message);
+	if(message != buf) tracefree(message);
+}
+
+/**
+ * Notes that a parser's file has something other than whitespace outside of 
+ * its include guard, if it has one.
+ */
+static __inline__ void unguard(pp_parser* self)
+{
+	if(self->guardState != PP_GUARD_OPEN)
+		self->guardState = PP_GUARD_NONE;
+}
+
+/**
+ * Follows a directive through the include guard pattern: the file must start 
+ * with "#ifndef X", and the matching "#endif" must end it, with no "#else" or 
+ * "#elif" in between.
+ */
+static void watch_guard(pp_parser* self, PP_TOKEN_TYPE directive)
+{
+	pp_lexer lexer;
+	pp_token name;
+	
+	switch(self->guardState)
+	{
+		case PP_GUARD_START:
+			self->guardState = PP_GUARD_NONE;
+			if(directive != PP_TOKEN_IFNDEF) return;
+			
+			// read the name ahead with a copy of the lexer, so that the parser's doesn't move
+			lexer = self->lexer;
+			do {
+				if(FAILED(pp_lexer_GetNextToken(&lexer, &name))) return;
+			} while(name.theType == PP_TOKEN_WHITESPACE);
+			if(name.theType != PP_TOKEN_IDENTIFIER || name.theAtom == 0) return;
+			
+			self->guard = name.theAtom;
+			self->guardDepth = num_conditionals;
+			self->guardState = PP_GUARD_OPEN;
+			break;
+		case PP_GUARD_OPEN:
+			if(num_conditionals != self->guardDepth + 1) return;
+			if(directive == PP_TOKEN_ENDIF)
+				self->guardState = PP_GUARD_CLOSED;
+			else if(directive == PP_TOKEN_ELSE || directive == PP_TOKEN_ELIF)
+				self->guardState = PP_GUARD_NONE;
+			break;
+		default:
+			self->guardState = PP_GUARD_NONE;
+	}
+}
+
+/**
+ * Preprocesses the entire source file.  Will shut down the engine if it fails 
+ * (no real way to recover), so no need for a return value.
+ */
+void pp_parser_parse(pp_parser* self)
+{
+	pp_token token;
+	unsigned int flags;
+	
+	self->newline = 1;
+	self->slashComment = 0;
+	self->starComment = 0;
+	parse_depth++;
+	
+	while(SUCCEEDED(pp_lexer_GetNextToken(&self->lexer, &token)))
+	{
+		switch(token.theType)
+		{
+			case PP_TOKEN_DIRECTIVE:
+				if(self->newline && !self->slashComment && !self->starComment)
+				{ /* only parse the "#" symbol when it's at the beginning of a 
+				   * line (ignoring whitespace) and not in a comment */
+					// directives are lexed in full so that their arguments are 
+					// classified and error messages show single tokens
+					flags = self->lexer.flags;
+					self->lexer.flags &= ~PP_LEXER_COARSE;
+					pp_parser_parse_directive(self);
+					self->lexer.flags = flags;
+				}
+				else
+				{
+					unguard(self);
+					emit(self, &token);
+				}
+				break;
+			case PP_TOKEN_COMMENT_SLASH:
+				if(!self->starComment) self->slashComment = 1;
+				self->newline = 0;
+				emit(self, &token);
+				break;
+			case PP_TOKEN_COMMENT_STAR_BEGIN:
+				if(!self->slashComment) self->starComment = 1;
+				self->newline = 0;
+				emit(self, &token);
+				break;
+			case PP_TOKEN_COMMENT_STAR_END:
+				self->starComment = 0;
+				self->newline = 0;
+				emit(self, &token);
+				break;
+			case PP_TOKEN_NEWLINE:
+				self->slashComment = 0;
+				self->newline = 1;
+				emit(self, &token);
+				break;
+			case PP_TOKEN_WHITESPACE:
+				emit(self, &token);
+				// whitespace doesn't affect the newline property
+				break;
+			case PP_TOKEN_IDENTIFIER:
+				unguard(self);
+				// macros aren't expanded in blocks that are skipped, where 
+				// their arguments might not even be complete
+				if(!skipping() && find_macro(&token)) pp_parser_insert_macro(self, &token);
+				else emit(self, &token);
+				break;
+			case PP_TOKEN_EOF:
+				emit(self, &token);
+				pp_lexer_Clear(&self->lexer); // frees the line index if a warning built one
+				if(--parse_depth == 0)
+				{
+					flush_output(self);
+					if(self->sink->finish) self->sink->finish(self->sink);
+				}
+				return; // we're done
+			default:
+				unguard(self);
+				self->newline = 0;
+				emit(self, &token);
+		}
+	}
+	
+	// if we get here, the stream doesn't have an EOF token
+	pp_error(self, "end of source code reached without EOF token");
+}
+
+/**
+ * Reads the rest of a directive's line.  The line break that ends it is 
+ * emitted, so the output keeps the same lines as the input; line breaks escaped 
+ * with a backslash are part of the line.
+ * @param length if not NULL, set to the length of the line
+ * @return the line, without the whitespace at the start or the line break at 
+ *         the end; it's only valid until the next line is read
+ */
+// FIXME: does not properly support comments on the same line after the message or macro definition
+char* pp_parser_readline(pp_parser* self, size_t* length)
+{
+	pp_token token;
+	
+	if(!pp_buffer_reserve(&directive_line, 0))
+		pp_error(self, "out of memory reading directive");
+	directive_line.length = 0;
+	directive_line.data[0] = '\0';
+	
+	skip_whitespace();
+	while(token.theType != PP_TOKEN_NEWLINE && token.theType != PP_TOKEN_EOF)
+	{
+		if(pp_token_Equals(&token, "\\")) pp_lexer_GetNextToken(&self->lexer, &token); // allows escaping line breaks with "\"
+		if(!pp_buffer_append(&directive_line, token.theSource, token.theLength))
+			pp_error(self, "out of memory reading directive");
+		pp_lexer_GetNextToken(&self->lexer, &token);
+	}
+	emit(self, &token);
+	
+	if(length) *length = directive_line.length;
+	return directive_line.data;
+}
+
+/**
+ * Parses the parameter list of a function-like macro.  When this function is 
+ * called, the next token is the '(' that starts the list.
+ * @param params where to store the atoms of the parameters
+ * @param variadic set to true if the list ends with "...", which is stored as 
+ *        a parameter named __VA_ARGS__
+ * @return the number of parameters
+ */
+int pp_parser_parse_params(pp_parser* self, pp_atom* params, bool* variadic)
+{
+	pp_token token;
+	int count = 0, i;
+	
+	pp_lexer_GetNextToken(&self->lexer, &token); // the '('
+	skip_whitespace();
+	if(token.theType == PP_TOKEN_RPAREN) return 0;
+	
+	while(1)
+	{
+		if(count == MAX_MACRO_PARAMS)
+			pp_error(self, "too many macro parameters; must be <= %i", MAX_MACRO_PARAMS);
+		
+		if(token.theType == PP_TOKEN_IDENTIFIER)
+		{
+			for(i=0; i<count; i++)
+				if(params[i] == token.theAtom)
+					pp_error(self, "duplicate macro parameter '%.*s'", token.theLength, token.theSource);
+			params[count++] = token.theAtom;
+		}
+		else if(token.theType == PP_TOKEN_FIELD)
+		{
+			// the lexer has no "..." token, so it comes as three '.' tokens
+			for(i=0; i<2; i++)
+			{
+				pp_lexer_GetNextToken(&self->lexer, &token);
+				if(token.theType != PP_TOKEN_FIELD) pp_error(self, "expected '...' in macro parameter list");
+			}
+			if(!(params[count++] = pp_intern(&atoms, "__VA_ARGS__", 11)))
+				pp_error(self, "out of memory defining macro");
+			*variadic = true;
+		}
+		else pp_error(self, "invalid macro parameter '%.*s'", token.theLength, token.theSource);
+		
+		skip_whitespace();
+		if(token.theType == PP_TOKEN_RPAREN) return count;
+		else if(token.theType != PP_TOKEN_COMMA || *variadic)
+			pp_error(self, "expected ')' or ',' in macro parameter list, got '%.*s'", token.theLength, token.theSource);
+		skip_whitespace();
+	}
+}
+
+/**
+ * Parses a C preprocessor directive.  When this function is called, the token
+ * '#' has just been detected by the compiler.
+ * 
+ * Currently supported directives are #include, #define, #undef, #ifdef, 
+ * #ifndef, #else, #endif, #warning and #error.
+ */
+void pp_parser_parse_directive(pp_parser* self) {
+	pp_token token;
+	
+	skip_whitespace();
+	if(self->guardState != PP_GUARD_NONE)
+		watch_guard(self, token.theType);
+	
+	// most directives shouldn't be parsed if we're in the middle of a conditional false
+	if(skipping())
+	{
+		if(token.theType != PP_TOKEN_ELIF &&
+		   token.theType != PP_TOKEN_ELSE &&
+		   token.theType != PP_TOKEN_ENDIF)
+		{
+			return;
+		}
+	}
+	
+	switch(token.theType)
+	{
+		case PP_TOKEN_INCLUDE:
+		{
+			char filename[MAX_PP_TOKEN_LENGTH+1];
+			skip_whitespace();
+			
+			if(token.theType != PP_TOKEN_STRING_LITERAL || token.theLength < 2)
+			{
+				pp_error(self, "couldn't interpret #include path '%.*s'", token.theLength, token.theSource);
+			}
+			else if(token.theLength - 2 > MAX_PP_TOKEN_LENGTH)
+			{
+				pp_error(self, "#include path is too long; must be <= %i characters", MAX_PP_TOKEN_LENGTH);
+			}
+			
+			// trim the " marks
+			memcpy(filename, token.theSource + 1, token.theLength - 2);
+			filename[token.theLength - 2] = '\0';
+			
+			pp_parser_include(self, filename);
+			break;
+		}
+		case PP_TOKEN_DEFINE:
+		{
+			// FIXME: this will only work if the macro name is on the same line as the "#define"
+			pp_token name;
+			pp_macro macro;
+			pp_atom params[MAX_MACRO_PARAMS];
+			char* contents;
+			size_t length;
+			
+			memset(&macro, 0, sizeof(macro));
+			skip_whitespace();
+			if(token.theType != PP_TOKEN_IDENTIFIER)
+			{
+				// Macro must have at least a name before the newline
+				pp_error(self, "no macro name given in #define directive");
+			}
+			
+			// Parse macro name, parameters and contents
+			name = token;
+			if(self->lexer.pcurChar < self->lexer.pend && *self->lexer.pcurChar == '(')
+			{
+				// a '(' right after the name starts a parameter list
+				macro.functionLike = true;
+				macro.paramCount = pp_parser_parse_params(self, params, &macro.variadic);
+			}
+			contents = pp_parser_readline(self, &length);
+			if((macro.contents = pp_arena_strndup(&macro_arena, contents, length)) == NULL)
+				pp_error(self, "out of memory defining macro");
+			
+			// Add macro to the table
+			define_macro(self, &name, &macro, params);
+			break;
+		}
+		case PP_TOKEN_UNDEF:
+		{
+			skip_whitespace();
+			if(token.theType == PP_TOKEN_IDENTIFIER)
+				undefine_macro(self, &token);
+			break;
+		}
+		case PP_TOKEN_IF:
+		case PP_TOKEN_IFDEF:
+		case PP_TOKEN_IFNDEF:
+		case PP_TOKEN_ELIF:
+		case PP_TOKEN_ELSE:
+		case PP_TOKEN_ENDIF:
+			pp_parser_conditional(self, token.theType);
+			break;
+		case PP_TOKEN_PRAGMA:
+		{
+			size_t length;
+			char* text = pp_parser_readline(self, &length);
+			
+			while(length > 0 && isspace((unsigned char)text[length - 1])) length--;
+			if(length == 4 && memcmp(text, "once", 4) == 0)
+				self->once = true;
+			else
+				pp_warning(self, "ignoring unknown pragma '%.*s'", (int)length, text);
+			break;
+		}
+		case PP_TOKEN_WARNING:
+		case PP_TOKEN_ERROR_TEXT:
+		{
+			PP_TOKEN_TYPE msgType = token.theType; // "token" is about to be clobbered, so save whether this is a warning or error
+			char* text = pp_parser_readline(self, NULL);
+			
+			if(msgType == PP_TOKEN_WARNING)
+				pp_warning(self, "#warning %s", text);
+			else
+				pp_error(self, "#error %s", text);
+			break;
+		}
+		default:
+			pp_error(self, "unknown directive '%.*s'", token.theLength, token.theSource);
+	}
+}
+
+#if PP_TEST
+#define INCLUDE_KEY_SIZE	PATH_MAX
+#else
+#define INCLUDE_KEY_SIZE	(MAX_PP_TOKEN_LENGTH + 1)
+#endif
+
+/**
+ * Normalizes a path the way packfiles compare them: case doesn't matter, '\\' 
+ * is the same as '/', and "." components, repeated slashes and components 
+ * followed by ".." don't matter either.  The result is never longer than 
+ * the path.
+ * @param key receives the normalized path
+ * @return the length of the normalized path
+ */
+static int normalize_path(const char* path, char* key)
+{
+	int length = 0, start, i;
+	
+	if(*path == '/' || *path == '\\') key[length++] = '/';
+	start = length; // ".." can't remove anything before this
+	for(;;)
+	{
+		const char* end;
+		
+		while(*path == '/' || *path == '\\') path++;
+		for(end = path; *end && *end != '/' && *end != '\\'; end++);
+		if(end == path) break;
+		
+		// "." changes nothing, and neither does ".." at the root
+		if((end - path == 1 && path[0] == '.') || 
+		   (end - path == 2 && path[0] == '.' && path[1] == '.' && length == 1 && key[0] == '/'))
+			;
+		else if(end - path == 2 && path[0] == '.' && path[1] == '.' && length > start)
+		{
+			while(length > start && key[length - 1] != '/') length--;
+			if(length > start) length--;
+		}
+		else
+		{
+			if(length > 0 && key[length - 1] != '/') key[length++] = '/';
+			for(i=0; i<end - path; i++)
+				key[length++] = tolower((unsigned char)path[i]);
+			// a ".." that couldn't be collapsed stays
+			if(end - path == 2 && path[0] == '.' && path[1] == '.')
+				start = length;
+		}
+		path = end;
+	}
+	key[length] = '\0';
+	return length;
+}
+
+/**
+ * Finds the entry for an included file in the cache, adding an empty one if 
+ * it isn't there yet.  Entries are keyed by the file's resolved path under 
+ * PP_TEST, or otherwise by its normalized path, so all the ways of writing 
+ * the path of a file share one entry, guard and set of statistics.
+ * @return the atom of the file's key, which indexes the entry
+ */
+static pp_atom find_include(pp_parser* self, char* filename)
+{
+	char key[INCLUDE_KEY_SIZE];
+	int length;
+	pp_atom atom;
+	
+	if(strlen(filename) >= INCLUDE_KEY_SIZE)
+		pp_error(self, "#include path is too long: '%s'", filename);
+#if PP_TEST
+	if(realpath(filename, key))
+		length = strlen(key);
+	else
+#endif
+		length = normalize_path(filename, key);
+	
+	atom = pp_intern(&includes.paths, key, length);
+	if(atom == 0)
+		pp_error(self, "out of memory including file '%s'", filename);
+	if(atom >= includes.capacity)
+	{
+		pp_atom capacity = includes.paths.atomCapacity;
+		pp_include_file* grown = tracerealloc(includes.byAtom, capacity * sizeof(pp_include_file), 
+		                                      includes.capacity * sizeof(pp_include_file));
+		if(grown == NULL)
+			pp_error(self, "out of memory including file '%s'", filename);
+		memset(grown + includes.capacity, 0, (capacity - includes.capacity) * sizeof(pp_include_file));
+		includes.byAtom = grown;
+		includes.capacity = capacity;
+	}
+	return atom;
+}
+
+#if PP_TEST
+/**
+ * Maps an included file into memory, read-only.  The file is identified 
+ * while it's open, too.  An empty file can't be mapped, and doesn't need to 
+ * be; its contents are an empty string that's never unmapped.
+ * @return false if the file can't be mapped
+ */
+static bool map_include(char* filename, pp_include_file* file)
+{
+	struct stat info;
+	void* contents;
+	int fd = open(filename, O_RDONLY);
+	
+	if(fd < 0) return false;
+	if(fstat(fd, &info) != 0 || info.st_size > INT_MAX)
+	{
+		close(fd);
+		return false;
+	}
+	if(info.st_size == 0)
+		contents = "";
+	else
+		contents = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(contents == MAP_FAILED) return false;
+	
+	file->contents = contents;
+	file->length = info.st_size;
+	file->mapped = true;
+	file->id.device = info.st_dev;
+	file->id.inode = info.st_ino;
+	file->identified = true;
+	includes.stats.bytes += file->length;
+	return true;
+}
+#endif
+
+/**
+ * Reads an included file into its entry in the cache, or maps it if it's on 
+ * the file system.
+ */
+static void read_include(pp_parser* self, char* filename, pp_include_file* file)
+{
+	char* buffer;
+	int length;
+	int bytes_read;
+	intptr_t handle;
+	
+#if PP_TEST
+	if(map_include(filename, file)) return;
+#endif
+	
+	// Open the file
+	handle = openpackfile(filename, packfile);
+#ifdef PP_TEST
+	if(!handle)
+#else
+	if(handle < 0)
+#endif
+	{
+		pp_error(self, "unable to open file '%s'", filename);
+	}
+	
+	// Determine the file's size
+	seekpackfile(handle, 0, SEEK_END);
+	length = tellpackfile(handle);
+	seekpackfile(handle, 0, SEEK_SET);
+	
+	// Allocate a buffer for the file's contents; it doesn't need a NUL, but an 
+	// empty file still needs a buffer
+	buffer = tracemalloc("pp_parser_include", length ? length : 1);
+	if(buffer == NULL)
+	{
+		closepackfile(handle);
+		pp_error(self, "out of memory reading file '%s'", filename);
+	}
+	
+	// Read the file into the buffer
+	bytes_read = readpackfile(handle, buffer, length);
+	closepackfile(handle);
+	
+	if(bytes_read != length)
+	{
+		pp_error(self, "I/O error: %s", strerror(errno));
+	}
+	
+	file->contents = buffer;
+	file->length = length;
+	file->mapped = false;
+	includes.stats.bytes += length;
+}
+
+/**
+ * Works out the identity of an included file, unless that's been done.  On 
+ * the file system, that doesn't need the file to have been read.
+ */
+static void identify_include(pp_parser* self, char* filename, pp_include_file* file)
+{
+	uint64_t hash = 14695981039346656037ull;
+	int i;
+#if PP_TEST
+	struct stat info;
+#endif
+	
+	if(file->identified) return;
+#if PP_TEST
+	if(stat(filename, &info) == 0)
+	{
+		file->id.device = info.st_dev;
+		file->id.inode = info.st_ino;
+		file->identified = true;
+		return;
+	}
+#endif
+	if(file->contents == NULL)
+	{
+		includes.stats.misses++;
+		read_include(self, filename, file);
+	}
+	
+	// FNV-1a
+	for(i=0; i<file->length; i++)
+		hash = (hash ^ (unsigned char)file->contents[i]) * 1099511628211ull;
+	file->id.device = (uint64_t)file->length | (1ull << 63);
+	file->id.inode = hash;
+	file->identified = true;
+}
+
+/**
+ * Finds a file identity's slot in the "#pragma once" table, or the empty slot 
+ * where it would go.
+ * Pre: the table has been allocated
+ */
+static int find_once(pp_file_id* id)
+{
+	uint64_t hash = (id->device * 0x9e3779b97f4a7c15ull) ^ id->inode;
+	int mask = once_files.capacity - 1;
+	int i;
+	
+	for(i = (int)(hash ^ (hash >> 32)) & mask; once_files.used[i]; i = (i + 1) & mask)
+	{
+		if(once_files.slots[i].device == id->device && once_files.slots[i].inode == id->inode)
+			break;
+	}
+	return i;
+}
+
+/**
+ * Adds a file identity to the "#pragma once" table.
+ */
+static void add_once(pp_parser* self, pp_file_id* id)
+{
+	int i;
+	
+	// keep the load factor at or below 1/2
+	if((once_files.count + 1) * 2 > once_files.capacity)
+	{
+		pp_file_id* slots = once_files.slots;
+		bool* used = once_files.used;
+		int capacity = once_files.capacity;
+		
+		once_files.capacity = capacity ? capacity * 2 : 64;
+		once_files.slots = tracemalloc("pp_parser once", once_files.capacity * sizeof(pp_file_id));
+		once_files.used = tracecalloc("pp_parser once", once_files.capacity * sizeof(bool));
+		if(once_files.slots == NULL || once_files.used == NULL)
+			pp_error(self, "out of memory including file");
+		for(i=0; i<capacity; i++)
+		{
+			int j;
+			if(!used[i]) continue;
+			j = find_once(&slots[i]);
+			once_files.slots[j] = slots[i];
+			once_files.used[j] = true;
+		}
+		if(slots) tracefree(slots);
+		if(used) tracefree(used);
+	}
+	
+	i = find_once(id);
+	if(once_files.used[i]) return;
+	once_files.slots[i] = *id;
+	once_files.used[i] = true;
+	once_files.count++;
+}
+
+/**
+ * @return true if a file has been marked "#pragma once" by the current script, 
+ *         under its own path or any other
+ */
+static bool marked_once(pp_parser* self, char* filename, pp_include_file* file)
+{
+	// a path that's been seen is rejected without touching the file
+	if(file->once == includes.generation) return true;
+	if(once_files.count == 0) return false;
+	
+	identify_include(self, filename, file);
+	if(!once_files.used[find_once(&file->id)]) return false;
+	file->once = includes.generation;
+	return true;
+}
+
+/**
+ * @return true if a file has an include guard that's defined, so including 
+ *         it again would do nothing
+ */
+static bool guard_defined(pp_include_file* file)
+{
+	const char* name;
+	pp_atom atom;
+	
+	if(file->guard == 0) return false;
+	
+	// the guard's atom changes with every script unless the atoms are retained
+	name = pp_intern_name(&includes.guards, file->guard);
+	atom = pp_intern_find(&atoms, name, includes.guards.atoms[file->guard].length);
+	return atom && atom < macros.capacity && macros.byAtom[atom].defined;
+}
+
+/**
+ * Includes a source file specified with the #include directive.  Files are 
+ * read from the cache, and files whose include guard is defined are skipped 
+ * without being read or parsed at all.
+ * @param filename the path to include
+ */
+void pp_parser_include(pp_parser* self, char* filename)
+{
+	pp_parser incparser;
+	pp_atom atom = find_include(self, filename);
+	pp_include_file* file = &includes.byAtom[atom];
+	
+	if(guard_defined(file) || marked_once(self, filename, file))
+	{
+		includes.stats.skips++;
+		return;
+	}
+	if(file->contents)
+		includes.stats.hits++;
+	else
+	{
+		includes.stats.misses++;
+		read_include(self, filename, file);
+	}
+	
+	// Parse the source code in the buffer
+	pp_parser_init_length(&incparser, self->script, filename, file->contents, file->length, self->sink);
+	pp_parser_parse(&incparser);
+	
+	// remember the include guard; includes within the file may have moved the entry
+	if(incparser.guardState == PP_GUARD_CLOSED)
+	{
+		const char* name = pp_intern_name(&atoms, incparser.guard);
+		pp_atom guard = pp_intern(&includes.guards, name, atoms.atoms[incparser.guard].length);
+		includes.byAtom[atom].guard = guard;
+	}
+	else
+		includes.byAtom[atom].guard = 0;
+	
+	if(incparser.once)
+	{
+		file = &includes.byAtom[atom];
+		identify_include(self, filename, file);
+		add_once(self, &file->id);
+		file->once = includes.generation;
+	}
+}
+
+/**
+ * Handles conditional directives.
+ * @param directive the type of conditional directive
+ */
+void pp_parser_conditional(pp_parser* self, PP_TOKEN_TYPE directive)
+{
+	switch(directive)
+	{
+		case PP_TOKEN_IF:
+		case PP_TOKEN_IFDEF:
+		case PP_TOKEN_IFNDEF:
+			if(num_conditionals++ > 16) pp_error(self, "too many levels of nested conditional directives");
+			conditionals.all <<= 2; // push a new conditional state onto the stack
+			conditionals.top = pp_parser_eval_conditional(self, directive) ? cs_true : cs_false;
+			break;
+		case PP_TOKEN_ELIF:
+			if(conditionals.top == cs_done || conditionals.top == cs_true)
+				conditionals.top = cs_done;
+			else
+				conditionals.top = pp_parser_eval_conditional(self, directive) ? cs_true : cs_false;
+			break;
+		case PP_TOKEN_ELSE:
+			if(conditionals.top == cs_none) pp_error(self, "stray #else");
+			conditionals.top = (conditionals.top == cs_false) ? cs_true : cs_false;
+			break;
+		case PP_TOKEN_ENDIF:
+			if(conditionals.top == cs_none || num_conditionals-- < 0) pp_error(self, "stray #endif");
+			conditionals.all >>= 2; // pop a conditional state from the stack
+			break;
+		default:
+			pp_error(self, "unknown conditional directive type (ID=%d)", directive);
+	}
+}
+
+bool pp_parser_eval_conditional(pp_parser* self, PP_TOKEN_TYPE directive)
+{
+	pp_token token;
+	
+	// all directives have whitespace between the directive and the contents
+	skip_whitespace();
+	
+	switch(directive)
+	{
+		case PP_TOKEN_IFDEF:
+			return find_macro(&token) != NULL;
+		case PP_TOKEN_IFNDEF:
+			return find_macro(&token) == NULL;
+		case PP_TOKEN_IF:
+			pp_error(self, "#if directive not yet supported");
+			break;
+		case PP_TOKEN_ELIF:
+			pp_error(self, "#elif directive not yet supported");
+			break;
+		default:
+			pp_error(self, "internal error: evaluating an unknown conditional type");
+	}
+	
+	return false;
+}
+
+/**
+ * @return true if the next token to be scanned, not counting whitespace and 
+ *         line breaks, is '('.  Nothing is consumed.
+ */
+static bool next_is_lparen(pp_parser* self)
+{
+	pp_lexer lexer;
+	pp_token token;
+	int i, j;
+	
+	for(i=contexts.count-1; i>=0; i--)
+	{
+		pp_context* context = &contexts.stack[i];
+		for(j=context->position; j<context->end; j++)
+		{
+			PP_TOKEN_TYPE type = (*context->tokens)[j].theType;
+			if(type != PP_TOKEN_WHITESPACE && type != PP_TOKEN_NEWLINE)
+				return type == PP_TOKEN_LPAREN;
+		}
+		
+		// an argument is expanded as if nothing followed it
+		if(context->argument) return false;
+		
+		// whatever a recorded macro expands to now depends on what follows it
+		if(context->capture >= 0) recording.captures[context->capture].unstable = true;
+	}
+	
+	// look ahead with a copy of the lexer, so that the parser's doesn't move
+	lexer = self->lexer;
+	do {
+		if(FAILED(pp_lexer_GetNextToken(&lexer, &token))) return false;
+	} while(token.theType == PP_TOKEN_WHITESPACE || token.theType == PP_TOKEN_NEWLINE);
+	return token.theType == PP_TOKEN_LPAREN;
+}
+
+/**
+ * "Paints" the name of a macro that's expanding, so that it's never expanded.
+ */
+static void paint(pp_token* token)
+{
+	int i;
+	
+	// what a macro nested in the painted one expands to can't be memoized, 
+	// since it depends on the painted one expanding too
+	for(i=contexts.count-1; i>=0 && contexts.stack[i].macro != token->theAtom; i--)
+	{
+		if(contexts.stack[i].capture >= 0)
+			recording.captures[contexts.stack[i].capture].unstable = true;
+	}
+	token->theAtom = 0;
+}
+
+/**
+ * Emits a token of an expansion, or collects it on the prescan stack if an 
+ * argument is being expanded.
+ */
+static __inline__ void put_token(pp_parser* self, pp_token* token)
+{
+	if(prescan.depth == 0)
+	{
+		emit(self, token);
+		return;
+	}
+	reserve_one(self, (void**)&prescan.tokens, prescan.count, &prescan.capacity, sizeof(pp_token));
+	prescan.tokens[prescan.count++] = *token;
+}
+
+/**
+ * Pushes a context for the expansion of a macro, and disables the macro.
+ */
+static pp_context* push_context(pp_parser* self, pp_atom macro, pp_token** tokens, int position, int end)
+{
+	pp_context* context;
+	
+	reserve_one(self, (void**)&contexts.stack, contexts.count, &contexts.capacity, sizeof(pp_context));
+	context = &contexts.stack[contexts.count++];
+	context->tokens = tokens;
+	context->position = position;
+	context->end = end;
+	context->macro = macro;
+	context->argument = false;
+	context->capture = -1;
+	context->tokenBase = scratch.tokenCount;
+	context->argBase = scratch.argCount;
+	context->newlines = 0;
+	if(macro) macros.byAtom[macro].expanding = true;
+	return context;
+}
+
+/**
+ * Pops the context on top of the stack.
+ * @param heir NULL to pop the scratch stacks back to where they were and emit 
+ *        the context's line breaks; or the context of an expansion whose 
+ *        arguments ran past the end of this one, which does that instead 
+ *        when it's done, since its arguments are on top of the stacks
+ */
+static void pop_context(pp_parser* self, pp_context* heir)
+{
+	pp_context* context = &contexts.stack[--contexts.count];
+	pp_token newline;
+	int newlines = context->newlines;
 	
-	// free the token buffer
-	if(tokens != NULL)
+	if(context->macro) macros.byAtom[context->macro].expanding = false;
+	if(context->capture >= 0)
+		end_capture(self);
+	if(heir)
 	{
-		tracefree(tokens);
-		tokens = NULL;
-		token_bufsize = tokens_length = 0;
+		heir->tokenBase = context->tokenBase;
+		heir->argBase = context->argBase;
+		heir->newlines += newlines;
+		return;
 	}
+	scratch.tokenCount = context->tokenBase;
+	scratch.argCount = context->argBase;
 	
-	// reset the conditional state
-	conditionals.all = 0;
+	// keep the lines of the output where they were
+	pp_token_Init(&newline, PP_TOKEN_NEWLINE, "\n", 1, 0);
+	while(newlines--) put_token(self, &newline);
 }
 
 /**
- * Exits the preprocessor with an error message.
+ * Reads the next token of a macro reference's argument list, from the context 
+ * on top of the stack or the parser's lexer.  Contexts that run out are popped 
+ * on the way, passing what they leave to be done on to the reference's.  Names 
+ * of macros that are expanding are painted as they're read, since the macros 
+ * may be done by the time the arguments are scanned.
+ * @return false at the end of the parser's input, or of the argument being 
+ *         expanded
  */
-void pp_error(pp_parser* self, char* format, ...)
+static bool next_token(pp_parser* self, pp_token* token, pp_context* heir)
 {
-	char buf[1024] = {""};
-	va_list arglist;
+	pp_macro* macro;
 	
-	va_start(arglist, format);
-	vsprintf(buf, format, arglist);
-	va_end(arglist);
-	shutdown(1, "Preprocessor error: %s: line %d: %s\n", self->filename, self->lexer.theTokenPosition.row + 1, buf);
+	while(contexts.count)
+	{
+		pp_context* context = &contexts.stack[contexts.count - 1];
+		if(context->position < context->end)
+		{
+			*token = (*context->tokens)[context->position++];
+			if(token->theType == PP_TOKEN_IDENTIFIER && (macro = find_macro(token)) && macro->expanding)
+				paint(token);
+			return true;
+		}
+		if(context->argument) return false;
+		
+		// whatever a recorded macro expands to now depends on what follows it
+		if(context->capture >= 0) recording.captures[context->capture].unstable = true;
+		pop_context(self, heir);
+	}
+	
+	if(FAILED(pp_lexer_GetNextToken(&self->lexer, token)))
+		pp_error(self, "unable to parse macro arguments");
+	return token->theType != PP_TOKEN_EOF;
 }
 
 /**
- * Writes a warning message to the log.
+ * Ends the macro argument on top of the stack, trimming the whitespace around it.
  */
-void pp_warning(pp_parser* self, char* format, ...)
+static void end_arg()
 {
-	char buf[1024] = {""};
-	va_list arglist;
+	pp_macro_arg* arg = &scratch.args[scratch.argCount - 1];
 	
-	va_start(arglist, format);
-	vsprintf(buf, format, arglist);
-	va_end(arglist);
-	printf("Preprocessor warning: %s: line %d: %s\n", self->filename, self->lexer.theTokenPosition.row + 1, buf);
+	arg->end = scratch.tokenCount;
+	while(arg->start < arg->end && scratch.tokens[arg->start].theType == PP_TOKEN_WHITESPACE) arg->start++;
+	while(arg->end > arg->start && scratch.tokens[arg->end - 1].theType == PP_TOKEN_WHITESPACE) arg->end--;
 }
 
 /**
- * Preprocesses the entire source file.  Will shut down the engine if it fails 
- * (no real way to recover), so no need for a return value.
+ * Collects the arguments of a reference to a function-like macro onto the 
+ * scratch stacks.  When this function is called, the next token to be scanned 
+ * is the first one after the '(' that starts the argument list.
+ * @param heir the context the expansion will have, which gets the line breaks 
+ *        in the arguments (they become spaces) and contexts popped on the way
  */
-void pp_parser_parse(pp_parser* self)
+static void collect_args(pp_parser* self, pp_macro* macro, pp_token* name, pp_context* heir)
 {
+	static pp_token space = {PP_TOKEN_WHITESPACE, " ", 1, 0, 0};
+	int first = scratch.argCount, depth = 0;
 	pp_token token;
 	
-	self->newline = 1;
-	self->slashComment = 0;
-	self->starComment = 0;
-	
-	while(SUCCEEDED(pp_lexer_GetNextToken(&self->lexer, &token)))
+	push_arg(self);
+	while(1)
 	{
-		switch(token.theType)
+		if(!next_token(self, &token, heir))
+			pp_error(self, "unterminated argument list invoking macro '%.*s'", name->theLength, name->theSource);
+		
+		if(token.theType == PP_TOKEN_LPAREN) depth++;
+		else if(token.theType == PP_TOKEN_RPAREN && depth-- == 0) break;
+		else if(token.theType == PP_TOKEN_COMMA && depth == 0 &&
+		        !(macro->variadic && scratch.argCount - first == macro->paramCount))
 		{
-			case PP_TOKEN_DIRECTIVE:
-				if(self->newline && !self->slashComment && !self->starComment)
-				{ /* only parse the "#" symbol when it's at the beginning of a 
-				   * line (ignoring whitespace) and not in a comment */
-					pp_parser_parse_directive(self);
-				} else emit(token);
-				break;
-			case PP_TOKEN_COMMENT_SLASH:
-				if(!self->starComment) self->slashComment = 1;
-				self->newline = 0;
-				emit(token);
-				break;
-			case PP_TOKEN_COMMENT_STAR_BEGIN:
-				if(!self->slashComment) self->starComment = 1;
-				self->newline = 0;
-				emit(token);
-				break;
-			case PP_TOKEN_COMMENT_STAR_END:
-				self->starComment = 0;
-				self->newline = 0;
-				emit(token);
-				break;
-			case PP_TOKEN_NEWLINE:
-				self->slashComment = 0;
-				self->newline = 1;
-				emit(token);
-				break;
-			case PP_TOKEN_WHITESPACE:
-				emit(token);
-				// whitespace doesn't affect the newline property
-				break;
-			case PP_TOKEN_IDENTIFIER:
-				if(List_FindByName(&macros, token.theSource)) pp_parser_insert_macro(self, token.theSource);
-				else emit(token);
-				break;
-			case PP_TOKEN_EOF:
-				emit(token);
-				return; // we're done
-			default:
-				self->newline = 0;
-				emit(token);
+			// the variadic argument takes the rest of the commas
+			end_arg();
+			push_arg(self);
+			continue;
+		}
+		else if(token.theType == PP_TOKEN_NEWLINE)
+		{
+			heir->newlines++;
+			token = space;
 		}
+		push_token(self, &token);
 	}
+	end_arg();
 	
-	// if we get here, the stream doesn't have an EOF token
-	pp_error(self, "end of source code reached without EOF token");
+	// "F()" passes one empty argument, which is right for one parameter and 
+	// means no arguments for none; a variadic argument may be left out
+	if(macro->paramCount == 0 && scratch.argCount - first == 1 &&
+	   scratch.args[first].start == scratch.args[first].end)
+		scratch.argCount--;
+	else if(macro->variadic && scratch.argCount - first == macro->paramCount - 1)
+		push_arg(self);
+	
+	if(scratch.argCount - first != macro->paramCount)
+		pp_error(self, "macro '%.*s' takes %i arguments, but %i were given", name->theLength, 
+		         name->theSource, macro->paramCount, scratch.argCount - first);
 }
 
-// TODO: use resizable buffers to preclude these stupid overflow errors
-// FIXME: does not properly support comments on the same line after the message or macro definition
-void pp_parser_readline(pp_parser* self, char* buf, int bufsize)
+static void begin_expansion(pp_parser* self, pp_macro* macro, pp_token* name);
+
+/**
+ * Turns a macro argument into a string literal.  Each run of whitespace in it 
+ * becomes one space, and quotes and backslashes in its string and character 
+ * literals are escaped.
+ */
+static void stringize(pp_parser* self, pp_macro_arg* arg, pp_token* result)
 {
-	pp_token token;
-	int total_length = 1;
+	int length = 2, i;
+	char* text;
+	char* p;
 	
-	buf[0] = '\0';
-	skip_whitespace();
-	while(1)
+	// the text is written in one pass, into enough space to escape everything
+	for(i=arg->start; i<arg->end; i++)
+		length += scratch.tokens[i].theLength * 2;
+	if((text = p = pp_arena_alloc(&paste_arena, length)) == NULL)
+		pp_error(self, "out of memory expanding macro");
+	
+	*p++ = '"';
+	for(i=arg->start; i<arg->end; i++)
 	{
-		if((token.theType == PP_TOKEN_NEWLINE) || (token.theType == PP_TOKEN_EOF)) { emit(token); break; }
-		else if(strcmp(token.theSource, "\\") == 0) pp_lexer_GetNextToken(&self->lexer, &token); // allows escaping line breaks with "\"
+		pp_token* token = &scratch.tokens[i];
+		int j;
 		
-		if((total_length + strlen(token.theSource)) > bufsize)
+		if(token->theType == PP_TOKEN_WHITESPACE)
 		{
-			// Prevent buffer overflow
-			// FIXME: this is used for more than just macros now; change the message!
-			pp_error(self, "length of macro contents is too long; must be <= %i characters", bufsize);
+			if(p[-1] != ' ') *p++ = ' ';
+			continue;
+		}
+		for(j=0; j<token->theLength; j++)
+		{
+			char c = token->theSource[j];
+			if(token->theType == PP_TOKEN_STRING_LITERAL && (c == '"' || c == '\\'))
+				*p++ = '\\';
+			*p++ = c;
 		}
-		
-		strcat(buf, token.theSource);
-		total_length += strlen(token.theSource);
-		pp_lexer_GetNextToken(&self->lexer, &token);
 	}
+	*p++ = '"';
+	pp_token_Init(result, PP_TOKEN_STRING_LITERAL, text, p - text, 0);
 }
 
 /**
- * Parses a C preprocessor directive.  When this function is called, the token
- * '#' has just been detected by the compiler.
- * 
- * Currently supported directives are #include and #define. Support for #define 
- * is still limited, as macros can only be 512 characters long and "function-like" 
- * macros are not supported.
+ * Pastes a token onto the end of another.  Only the text of the new token is 
+ * lexed, to classify it; it must be a single token.
+ * @param left the token on the left, which is replaced by the new token
  */
-void pp_parser_parse_directive(pp_parser* self) {
+static void paste(pp_parser* self, pp_token* left, const pp_token* right)
+{
+	TEXTPOS initialPos = {0, 0};
+	int length = left->theLength + right->theLength;
+	pp_lexer lexer;
 	pp_token token;
+	char* text;
 	
-	skip_whitespace();
+	if((text = pp_arena_alloc(&paste_arena, length + 1)) == NULL)
+		pp_error(self, "out of memory expanding macro");
+	memcpy(text, left->theSource, left->theLength);
+	memcpy(text + left->theLength, right->theSource, right->theLength);
+	text[length] = '\0';
 	
-	// most directives shouldn't be parsed if we're in the middle of a conditional false
-	if(conditionals.top == cs_false || conditionals.top == cs_done)
-	{
-		if(token.theType != PP_TOKEN_ELIF &&
-		   token.theType != PP_TOKEN_ELSE &&
-		   token.theType != PP_TOKEN_ENDIF)
-		{
-			return;
-		}
-	}
+	pp_lexer_Init(&lexer, text, initialPos);
+	lexer.atoms = &atoms;
+	if(FAILED(pp_lexer_GetNextToken(&lexer, &token)) || token.theLength != length ||
+	   token.theType == PP_TOKEN_ERROR)
+		pp_error(self, "pasting \"%.*s\" and \"%.*s\" does not give a valid token", 
+		         left->theLength, left->theSource, right->theLength, right->theSource);
+	token.charOffset = left->charOffset;
+	*left = token;
+}
+
+/**
+ * Pushes the contents of a macro onto the token stack, with the arguments 
+ * substituted for the parameters and the operators applied.
+ * @param firstArg the index of the first argument on the argument stack
+ */
+static void substitute(pp_parser* self, pp_macro* macro, int firstArg)
+{
+	static pp_token space = {PP_TOKEN_WHITESPACE, " ", 1, 0, 0};
+	int group = scratch.tokenCount; // where the operand on the left of a '##' starts
+	int i, j;
 	
-	switch(token.theType)
+	for(i=0; i<macro->tokenCount; i++)
 	{
-		case PP_TOKEN_INCLUDE:
+		unsigned char op = macro->ops ? macro->ops[i] : 0;
+		int param = macro->paramIndex ? macro->paramIndex[i] : -1;
+		pp_token stringized;
+		pp_token* tokens = &macro->tokens[i];
+		int start = 0, end = 1;
+		
+		if(!(op & MACRO_OP_PASTE)) group = scratch.tokenCount;
+		if(op & MACRO_OP_STRINGIZE)
 		{
-			char* filename;
-			skip_whitespace();
-			
-			if(token.theType != PP_TOKEN_STRING_LITERAL)
-			{
-				pp_error(self, "couldn't interpret #include path '%s'", token.theSource);
-			}
-			
-			filename = token.theSource + 1; // trim first " mark
-			filename[strlen(filename)-1] = '\0'; // trim last " mark
-			
-			pp_parser_include(self, filename);
-			break;
+			stringize(self, &scratch.args[firstArg + param], &stringized);
+			tokens = &stringized;
 		}
-		case PP_TOKEN_DEFINE:
+		else if(param >= 0)
 		{
-			// FIXME: this will only work if the macro name is on the same line as the "#define"
-			// FIXME: length of contents is limited to MACRO_CONTENTS_SIZE (512) characters
-			char name[128];
-			char* contents = tracemalloc("pp_parser_define", MACRO_CONTENTS_SIZE);
+			pp_macro_arg* arg = &scratch.args[firstArg + param];
+			tokens = NULL;
+			start = (op & MACRO_OP_RAW) ? arg->start : arg->expandedStart;
+			end = (op & MACRO_OP_RAW) ? arg->end : arg->expandedEnd;
 			
-			skip_whitespace();
-			if(token.theType != PP_TOKEN_IDENTIFIER)
+			// ", ## __VA_ARGS__" drops the comma if there are no variadic 
+			// arguments, and doesn't paste anything otherwise
+			if((op & MACRO_OP_PASTE) && macro->variadic && param == macro->paramCount - 1 &&
+			   scratch.tokenCount > group && scratch.tokens[scratch.tokenCount - 1].theType == PP_TOKEN_COMMA)
 			{
-				// Macro must have at least a name before the newline
-				pp_error(self, "no macro name given in #define directive");
+				if(start == end) scratch.tokenCount--;
+				else push_token(self, &space);
+				group = scratch.tokenCount;
 			}
-			
-			// Parse macro name and contents
-			strcpy(name, token.theSource);
-			pp_parser_readline(self, contents, MACRO_CONTENTS_SIZE);
-			
-			// Add macro to list
-			List_InsertAfter(&macros, contents, name);
-			break;
 		}
-		case PP_TOKEN_UNDEF:
-			skip_whitespace();
-			if(List_FindByName(&macros, token.theSource))
-				List_Remove(&macros);
-			break;
-		case PP_TOKEN_IF:
-		case PP_TOKEN_IFDEF:
-		case PP_TOKEN_IFNDEF:
-		case PP_TOKEN_ELIF:
-		case PP_TOKEN_ELSE:
-		case PP_TOKEN_ENDIF:
-			pp_parser_conditional(self, token.theType);
-			break;
-		case PP_TOKEN_WARNING:
-		case PP_TOKEN_ERROR_TEXT:
+		
+		// an empty operand of '##' leaves the other one as it is
+		for(j=start; j<end; j++)
 		{
-			char text[256] = {""};
-			PP_TOKEN_TYPE msgType = token.theType; // "token" is about to be clobbered, so save whether this is a warning or error
-			
-			pp_parser_readline(self, text, sizeof(text));
-			
-			if(msgType == PP_TOKEN_WARNING)
-				pp_warning(self, "#warning %s", text);
+			// pushing can move the stack
+			pp_token token = tokens ? tokens[j - start] : scratch.tokens[j];
+			if(j == start && scratch.tokenCount > group)
+				paste(self, &scratch.tokens[scratch.tokenCount - 1], &token);
 			else
-				pp_error(self, "#error %s", text);
-			break;
+				push_token(self, &token);
 		}
-		default:
-			pp_error(self, "unknown directive '%s'", token.theSource);
 	}
 }
 
 /**
- * Includes a source file specified with the #include directive.
- * @param filename the path to include
+ * @return false if a memo can't be used because a macro its expansion depends 
+ *         on is expanding, and so would be painted rather than expanded
  */
-void pp_parser_include(pp_parser* self, char* filename)
+static bool memo_applies(pp_memo* memo)
 {
-	pp_parser incparser;
-	char* buffer;
-	int length;
-	int bytes_read;
-	int handle;
+	int i;
 	
-	// Open the file
-	handle = openpackfile(filename, packfile);
-#ifdef PP_TEST
-	if(!handle)
-#else
-	if(handle < 0)
-#endif
+	for(i=0; contexts.count && i<memo->depCount; i++)
 	{
-		pp_error(self, "unable to open file '%s'", filename);
+		if(memo->deps[i] < macros.capacity && macros.byAtom[memo->deps[i]].expanding)
+			return false;
 	}
+	return true;
+}
+
+/**
+ * Scans the contexts above a depth of the context stack, expanding the macros 
+ * among their tokens by pushing more contexts, until they've all been popped.  
+ * A name that refers to a macro that's already expanding is "painted blue": it 
+ * loses its atom, so that it's never expanded.
+ */
+static void scan(pp_parser* self, int depth)
+{
+	pp_macro* macro;
+	pp_token token;
 	
-	// Determine the file's size
-	seekpackfile(handle, 0, SEEK_END);
-	length = tellpackfile(handle);
-	seekpackfile(handle, 0, SEEK_SET);
-	
-	// Allocate a buffer for the file's contents
-	buffer = tracemalloc("pp_parser_include", length + 1);
-	memset(buffer, 0, length + 1);
-	
-	// Read the file into the buffer
-	bytes_read = readpackfile(handle, buffer, length);
-	closepackfile(handle);
-	
-	if(bytes_read != length)
+	while(contexts.count > depth)
 	{
-		pp_error(self, "I/O error: %s", strerror(errno));
+		pp_context* context = &contexts.stack[contexts.count - 1];
+		if(context->position == context->end)
+		{
+			pop_context(self, NULL);
+			continue;
+		}
+		
+		token = (*context->tokens)[context->position++];
+		if(token.theType == PP_TOKEN_IDENTIFIER && token.theAtom)
+		{
+			if(recording.count)
+				record_dep(self, token.theAtom);
+			if((macro = find_macro(&token)) && macro->expanding)
+				paint(&token);
+			else if(macro)
+			{
+				begin_expansion(self, macro, &token);
+				continue;
+			}
+		}
+		put_token(self, &token);
 	}
-	
-	// Parse the source code in the buffer
-	pp_parser_init(&incparser, self->script, filename, buffer);
-	pp_parser_parse(&incparser);
-	
-	// Free the buffer to prevent memory leaks
-	tracefree(buffer);
 }
 
 /**
- * Handles conditional directives.
- * @param directive the type of conditional directive
+ * Macro-expands an argument of the function-like macro being expanded, unless 
+ * that's been done already, and pushes the result onto the token stack.
  */
-void pp_parser_conditional(pp_parser* self, PP_TOKEN_TYPE directive)
+static void expand_arg(pp_parser* self, int index)
 {
-	switch(directive)
+	pp_context* context;
+	int start = prescan.count, depth = contexts.count, i;
+	
+	if(scratch.args[index].expandedStart >= 0) return;
+	
+	// most arguments don't name any macros, and expand to themselves
+	for(i=scratch.args[index].start; i<scratch.args[index].end; i++)
 	{
-		case PP_TOKEN_IF:
-		case PP_TOKEN_IFDEF:
-		case PP_TOKEN_IFNDEF:
-			if(num_conditionals++ > 16) pp_error(self, "too many levels of nested conditional directives");
-			conditionals.all <<= 2; // push a new conditional state onto the stack
-			conditionals.top = pp_parser_eval_conditional(self, directive) ? cs_true : cs_false;
-			break;
-		case PP_TOKEN_ELIF:
-			if(conditionals.top == cs_done || conditionals.top == cs_true)
-				conditionals.top = cs_done;
-			else
-				conditionals.top = pp_parser_eval_conditional(self, directive) ? cs_true : cs_false;
-			break;
-		case PP_TOKEN_ELSE:
-			if(conditionals.top == cs_none) pp_error(self, "stray #else");
-			conditionals.top = (conditionals.top == cs_false) ? cs_true : cs_false;
-			break;
-		case PP_TOKEN_ENDIF:
-			if(conditionals.top == cs_none || num_conditionals-- < 0) pp_error(self, "stray #endif");
-			conditionals.all >>= 2; // pop a conditional state from the stack
+		if(scratch.tokens[i].theType == PP_TOKEN_IDENTIFIER && find_macro(&scratch.tokens[i]))
 			break;
-		default:
-			pp_error(self, "unknown conditional directive type (ID=%d)", directive);
 	}
+	if(i == scratch.args[index].end)
+	{
+		scratch.args[index].expandedStart = scratch.args[index].start;
+		scratch.args[index].expandedEnd = scratch.args[index].end;
+		return;
+	}
+	
+	context = push_context(self, 0, &scratch.tokens, scratch.args[index].start, scratch.args[index].end);
+	context->argument = true;
+	prescan.depth++;
+	scan(self, depth);
+	prescan.depth--;
+	
+	scratch.args[index].expandedStart = scratch.tokenCount;
+	for(i=start; i<prescan.count; i++)
+		push_token(self, &prescan.tokens[i]);
+	scratch.args[index].expandedEnd = scratch.tokenCount;
+	prescan.count = start;
 }
 
-bool pp_parser_eval_conditional(pp_parser* self, PP_TOKEN_TYPE directive)
+/**
+ * Starts expanding a macro by pushing a context for it.  Function-like macros 
+ * take their arguments from the tokens that follow the reference, and aren't 
+ * expanded unless there are any.  Memoized macros are emitted right away.
+ * @param name the reference to the macro
+ */
+static void begin_expansion(pp_parser* self, pp_macro* macro, pp_token* name)
 {
+	pp_context* context, heir;
 	pp_token token;
+	int firstArg = scratch.argCount;
+	int i, j;
 	
-	// all directives have whitespace between the directive and the contents
-	skip_whitespace();
+	// an object-like macro with '##' has to be substituted like a function-like one
+	if(!macro->functionLike && macro->ops)
+	{
+		i = scratch.tokenCount;
+		substitute(self, macro, firstArg);
+		context = push_context(self, name->theAtom, &scratch.tokens, i, scratch.tokenCount);
+		context->tokenBase = i;
+		if(!macro->unstable && !prescan.depth && macro->uses++ > 0)
+			context->capture = begin_capture(self, name->theAtom);
+		return;
+	}
+	else if(!macro->functionLike)
+	{
+		// memos are emitted straight to the output, so arguments expand macros in full
+		if(macro->memo && !prescan.depth && memo_applies(macro->memo))
+			emit_memo(self, macro->memo);
+		else
+		{
+			context = push_context(self, name->theAtom, &macro->tokens, 0, macro->tokenCount);
+			
+			// record the expansion to memoize it if the macro is used again
+			if(!macro->unstable && !prescan.depth && macro->uses++ > 0)
+				context->capture = begin_capture(self, name->theAtom);
+		}
+		return;
+	}
+	if(!next_is_lparen(self))
+	{
+		put_token(self, name);
+		return;
+	}
 	
-	switch(directive)
+	// skip to the '(' and collect the arguments
+	heir.tokenBase = scratch.tokenCount;
+	heir.argBase = firstArg;
+	heir.newlines = 0;
+	do {
+		next_token(self, &token, &heir);
+		if(token.theType == PP_TOKEN_NEWLINE) heir.newlines++;
+	} while(token.theType != PP_TOKEN_LPAREN);
+	collect_args(self, macro, name, &heir);
+	
+	// expand the arguments that are used, then substitute them into the 
+	// contents on top of the token stack
+	for(j=0; j<macro->tokenCount; j++)
 	{
-		case PP_TOKEN_IFDEF:
-			return List_FindByName(&macros, token.theSource);
-		case PP_TOKEN_IFNDEF:
-			return !List_FindByName(&macros, token.theSource);
-		case PP_TOKEN_IF:
-			pp_error(self, "#if directive not yet supported");
-			break;
-		case PP_TOKEN_ELIF:
-			pp_error(self, "#elif directive not yet supported");
-			break;
-		default:
-			pp_error(self, "internal error: evaluating an unknown conditional type");
+		if(macro->paramIndex[j] >= 0 && !(macro->ops && (macro->ops[j] & (MACRO_OP_STRINGIZE | MACRO_OP_RAW))))
+			expand_arg(self, firstArg + macro->paramIndex[j]);
 	}
+	i = scratch.tokenCount;
+	substitute(self, macro, firstArg);
 	
-	return false;
+	// the context owns the arguments and contents, and pops them with itself
+	context = push_context(self, name->theAtom, &scratch.tokens, i, scratch.tokenCount);
+	context->tokenBase = heir.tokenBase;
+	context->argBase = heir.argBase;
+	context->newlines = heir.newlines;
 }
 
 /**
- * Expands a macro.
+ * Expands a macro referenced in the parser's input.  The expansion is scanned 
+ * for more macros, which are expanded in turn, using the context stack rather 
+ * than recursion.
  * Pre: the macro is defined
+ * @param token the macro's name
  */
-void pp_parser_insert_macro(pp_parser* self, char* name)
+void pp_parser_insert_macro(pp_parser* self, pp_token* token)
 {
-	pp_parser macroParser;
+	unsigned int flags = self->lexer.flags;
+	int macroLine = self->macroLine;
+	
+	// everything a macro expands to belongs to the line of the outermost reference
+	if(self->sink->token && macroLine < 0)
+		self->macroLine = token_line(self, token);
 	
-	List_FindByName(&macros, name);
-	pp_parser_init(&macroParser, self->script, self->filename, List_Retrieve(&macros));
-	pp_parser_parse(&macroParser);
+	// arguments are lexed in full so that they can be split at the commas
+	self->lexer.flags &= ~PP_LEXER_COARSE;
+	begin_expansion(self, find_macro(token), token);
+	scan(self, 0);
+	self->lexer.flags = flags;
+	
+	// the token sink has copied the text that was pasted
+	if(self->sink->write == NULL)
+		pp_arena_clear(&paste_arena);
+	self->macroLine = macroLine;
 }
-
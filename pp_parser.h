@@ -19,33 +19,64 @@
 #define PP_PARSER_H
 
 #include "pp_lexer.h"
+#include "pp_sink.h"
 #include "types.h"
 #include "openborscript.h"
 
-#define MACRO_CONTENTS_SIZE		512
+#define MAX_MACRO_PARAMS		64
+
+// How far a parser has got in recognizing its file as wrapped in an include 
+// guard ("#ifndef X" at the start, and its "#endif" at the end).
+typedef enum PP_GUARD_STATE {
+    PP_GUARD_START,  // nothing but whitespace so far
+    PP_GUARD_OPEN,   // inside the "#ifndef"
+    PP_GUARD_CLOSED, // nothing but whitespace since the "#endif"
+    PP_GUARD_NONE    // the file isn't guarded
+} PP_GUARD_STATE;
 
 typedef struct pp_parser {
     Script* script;
+    pp_sink* sink;
     pp_lexer lexer;
     char* filename;
     char* sourceCode;
     bool slashComment;
     bool starComment;
     bool newline;
+    int macroLine; // line of the macro reference being expanded, or -1
+    PP_GUARD_STATE guardState;
+    pp_atom guard;  // the include guard macro, once it's been seen
+    int guardDepth; // the number of conditionals the include guard is nested in
+    bool once;      // the file has "#pragma once"
 } pp_parser;
 
+// Counts kept by the include cache since it was last flushed.
+typedef struct pp_include_stats {
+    int hits;     // includes of files that were already cached
+    int misses;   // includes that read the file
+    int skips;    // includes skipped because of an include guard or "#pragma once"
+    size_t bytes; // total size of the files read
+} pp_include_stats;
+
+// The output of parsers initialized without a sink.
 // FIXME: nothing outside of pp_parser has any business accessing the token buffer
 extern char* tokens;
 
-void pp_parser_init(pp_parser* self, Script* script, char* filename, char* sourceCode);
+void pp_parser_init(pp_parser* self, Script* script, char* filename, char* sourceCode, pp_sink* sink);
+void pp_parser_init_length(pp_parser* self, Script* script, char* filename, char* sourceCode, 
+                           size_t length, pp_sink* sink);
 void pp_parser_reset();
+void pp_parser_retain_atoms(bool retain);
+void pp_parser_flush_includes();
+pp_include_stats pp_parser_include_stats();
 void pp_error(pp_parser* self, char* format, ...);
 void pp_parser_parse(pp_parser* self);
 void pp_parser_parse_directive(pp_parser* self);
+int pp_parser_parse_params(pp_parser* self, pp_atom* params, bool* variadic);
 void pp_parser_include(pp_parser* self, char* filename);
 void pp_parser_conditional(pp_parser* self, PP_TOKEN_TYPE directive);
 bool pp_parser_eval_conditional(pp_parser* self, PP_TOKEN_TYPE directive);
-void pp_parser_insert_macro(pp_parser* self, char* name);
+void pp_parser_insert_macro(pp_parser* self, pp_token* token);
 
 #endif
 
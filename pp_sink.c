@@ -0,0 +1,173 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Output sinks for the script preprocessor.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pp_sink.h"
+
+#if PP_TEST
+#define tracemalloc(name, size)		malloc(size)
+#define tracerealloc(ptr, size, os)	realloc(ptr, size)
+#define tracefree(ptr)				free(ptr)
+#else
+#include "tracemalloc.h"
+#endif
+
+/**
+ * Appends an unsigned integer to a buffer, 7 bits per byte starting with the
+ * lowest; the high bit of each byte is set if another byte follows.
+ */
+static bool put_varint(pp_buffer* buffer, unsigned int value)
+{
+	char bytes[5];
+	int length = 0;
+
+	while(value >= 0x80)
+	{
+		bytes[length++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	bytes[length++] = (char)value;
+	return pp_buffer_append(buffer, bytes, length);
+}
+
+/**
+ * Reads an integer written by put_varint().
+ * @return false if it runs past "end" or doesn't fit in an unsigned int
+ */
+static bool get_varint(const unsigned char** p, const unsigned char* end, unsigned int* value)
+{
+	unsigned int result = 0;
+	int shift = 0;
+
+	do
+	{
+		if(*p == end || shift > 28) return false;
+		result |= (unsigned int)(**p & 0x7f) << shift;
+		shift += 7;
+	} while(*(*p)++ & 0x80);
+	*value = result;
+	return true;
+}
+
+/**
+ * @return the index of a file name in the sink's table, adding it if needed,
+ *         or -1 if it can't be added
+ */
+static int filename_index(pp_token_sink* self, const char* filename)
+{
+	char** filenames;
+	int i;
+
+	// a script has few files, and the newest ones are the likeliest matches
+	for(i=self->filenameCount-1; i>=0; i--)
+		if(strcmp(self->filenames[i], filename) == 0) return i;
+
+	filenames = tracerealloc(self->filenames, (self->filenameCount + 1) * sizeof(char*),
+	                         self->filenameCount * sizeof(char*));
+	if(filenames == NULL) return -1;
+	self->filenames = filenames;
+
+	filenames[self->filenameCount] = tracemalloc("pp_token_sink filename", strlen(filename) + 1);
+	if(filenames[self->filenameCount] == NULL) return -1;
+	strcpy(filenames[self->filenameCount], filename);
+	return self->filenameCount++;
+}
+
+static bool token_sink_token(pp_sink* sink, const pp_token* token, const char* filename, int line)
+{
+	pp_token_sink* self = (pp_token_sink*)sink;
+	char type = (char)token->theType;
+	int file;
+
+	switch(token->theType)
+	{
+		case PP_TOKEN_WHITESPACE:
+		case PP_TOKEN_NEWLINE:
+		case PP_TOKEN_COMMENT_SLASH:
+		case PP_TOKEN_COMMENT_STAR_BEGIN:
+		case PP_TOKEN_COMMENT_STAR_END:
+		case PP_TOKEN_EOF:
+			return true;
+		default:
+			break;
+	}
+
+	file = filename_index(self, filename ? filename : "");
+	if(file < 0) return false;
+
+	self->count++;
+	return pp_buffer_append(&self->records, &type, 1) &&
+	       put_varint(&self->records, file) &&
+	       put_varint(&self->records, line) &&
+	       put_varint(&self->records, token->theLength) &&
+	       pp_buffer_append(&self->records, token->theSource, token->theLength);
+}
+
+/**
+ * Initializes an empty token sink, ready to be passed to pp_parser_init().
+ */
+void pp_token_sink_init(pp_token_sink* self)
+{
+	self->sink.write = NULL;
+	self->sink.finish = NULL;
+	self->sink.token = token_sink_token;
+	pp_buffer_init(&self->records);
+	self->filenames = NULL;
+	self->filenameCount = 0;
+	self->count = 0;
+}
+
+/**
+ * Frees the tokens held by a token sink and leaves it empty.
+ */
+void pp_token_sink_clear(pp_token_sink* self)
+{
+	int i;
+
+	for(i=0; i<self->filenameCount; i++)
+		tracefree(self->filenames[i]);
+	if(self->filenames) tracefree(self->filenames);
+	pp_buffer_clear(&self->records);
+	pp_token_sink_init(self);
+}
+
+/**
+ * Reads the next token from a token sink.
+ * @param position where to read from; start at 0, and the position of the
+ *        following token is stored back
+ * @return false if there are no more tokens, or if the token at the position
+ *         is cut short or names a file the sink doesn't have
+ */
+bool pp_token_sink_read(const pp_token_sink* self, size_t* position, pp_sink_token* token)
+{
+	const unsigned char *p, *end;
+	unsigned int type, file, line, length;
+
+	if(*position >= self->records.length) return false;
+	p = (const unsigned char*)self->records.data + *position;
+	end = (const unsigned char*)self->records.data + self->records.length;
+
+	type = *p++;
+	if(!get_varint(&p, end, &file) || !get_varint(&p, end, &line) || !get_varint(&p, end, &length))
+		return false;
+	if(file >= (unsigned int)self->filenameCount || length > (size_t)(end - p))
+		return false;
+
+	token->type = type;
+	token->filename = self->filenames[file];
+	token->line = line;
+	token->length = length;
+	token->text = (const char*)p;
+	*position = (p - (const unsigned char*)self->records.data) + length;
+	return true;
+}
@@ -0,0 +1,75 @@
+/*
+ * OpenBOR - http://www.LavaLit.com
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in OpenBOR root for details.
+ *
+ * Copyright (c) 2004 - 2010 OpenBOR Team
+ */
+
+/**
+ * Output sinks for the script preprocessor.  A sink receives the preprocessed
+ * script as it's produced, so that it can go straight to its consumer instead
+ * of being held in memory.
+ *
+ * pp_token_sink is a sink that keeps the script as the tokens the preprocessor
+ * already classified, packed into a compact binary form, so that the script
+ * compiler can read them back without lexing the script a second time.
+ */
+
+#ifndef PP_SINK_H
+#define PP_SINK_H
+
+#include <stddef.h>
+#include "pp_lexer.h"
+#include "pp_buffer.h"
+
+/**
+ * write() is called with each piece of the output text in order; the text is
+ * only valid during the call.  token() is called with each token of the
+ * output, along with the file and line it came from (the line of the macro
+ * reference for tokens produced by a macro).  Either of them may be NULL if
+ * the sink doesn't need that form of the output; a sink with a token()
+ * function gets fully classified tokens instead of the coarse runs of text
+ * the preprocessor otherwise passes through.  Both return false to make the
+ * preprocessor fail.  finish() (which may also be NULL) is called once the
+ * whole script has been written.
+ *
+ * Sinks that need state of their own can embed a pp_sink as their first member.
+ */
+typedef struct pp_sink {
+	bool (*write)(struct pp_sink* self, const char* text, size_t length);
+	void (*finish)(struct pp_sink* self);
+	bool (*token)(struct pp_sink* self, const pp_token* token, const char* filename, int line);
+} pp_sink;
+
+/**
+ * The tokens of a script, minus whitespace, line breaks and comments.  Each
+ * token is stored as its type (one byte), then the index of its file name,
+ * its line and its length as variable-length integers, then its text.
+ */
+typedef struct pp_token_sink {
+	pp_sink sink;
+	pp_buffer records;
+	char** filenames;
+	int filenameCount;
+	int count;
+} pp_token_sink;
+
+/**
+ * One token read back from a pp_token_sink.  The text and file name belong to
+ * the sink and are valid until it's cleared.
+ */
+typedef struct pp_sink_token {
+	PP_TOKEN_TYPE type;
+	const char* text;
+	int length;
+	const char* filename;
+	int line;
+} pp_sink_token;
+
+void pp_token_sink_init(pp_token_sink* self);
+void pp_token_sink_clear(pp_token_sink* self);
+bool pp_token_sink_read(const pp_token_sink* self, size_t* position, pp_sink_token* token);
+
+#endif
+
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Runs pp_lexbench against the current lexer and against the lexer of an older 
+# revision, on the same input.  By default, that's the first commit, which has 
+# the original strncmp-based lexer.
+# Usage: bench_baseline.sh [revision [iterations [filename]]]
+# (pass "" as the revision to use the default with other arguments)
+
+cd "$(dirname "$0")"
+rev=${1:-$(git rev-list --max-parents=0 HEAD)}
+shift
+includes="-I../.. -I../../scriptlib -I../../tracelib -I../../gamelib -I../../.. -I../../ramlib"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/baseline"
+git show $rev:pp_lexer.c > "$work/baseline/pp_lexer.c" || exit 1
+git show $rev:pp_lexer.h > "$work/baseline/pp_lexer.h" || exit 1
+
+gcc -O2 pp_lexbench.c ../pp_lexer.c ../pp_intern.c ../pp_buffer.c -DPP_TEST -I.. $includes \
+	-o"$work/current" || exit 1
+gcc -O2 pp_lexbench.c "$work/baseline/pp_lexer.c" -DPP_TEST -I"$work/baseline" $includes \
+	-o"$work/baseline/pp_lexbench" || exit 1
+
+echo "current lexer:"
+"$work/current" "$@"
+echo "lexer at $rev:"
+"$work/baseline/pp_lexbench" "$@"
@@ -1,8 +1,9 @@
 #!/bin/bash
 
-gcc -g -O2 -Wall pp_test.c ../pp_parser.c ../pp_lexer.c List.c \
-	-DPP_TEST \
-	-I.. -I../.. -I../../scriptlib -I../../tracelib -I../../gamelib -I../../.. -I../../ramlib \
-	-opp_test
-
+for prog in pp_test pp_bench pp_scan_test pp_parser_test; do
+	gcc -g -O2 -Wall $prog.c ../pp_parser.c ../pp_lexer.c ../pp_buffer.c ../pp_sink.c ../pp_intern.c ../pp_arena.c \
+		-DPP_TEST \
+		-I.. -I../.. -I../../scriptlib -I../../tracelib -I../../gamelib -I../../.. -I../../ramlib \
+		-o$prog
+done
 
@@ -0,0 +1,402 @@
+// Quick program to measure the throughput of the preprocessor.
+// Compile using build.sh.  To compare the lexer with an older revision's, 
+// use bench_baseline.sh instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "pp_lexer.h"
+#include "pp_parser.h"
+#undef printf
+
+// returns the contents of a file in a NUL-terminated buffer, or NULL on failure
+char* readFile(char* filename, int* length)
+{
+	char* buffer;
+	FILE* fp = fopen(filename, "rb");
+	if(fp == NULL) return NULL;
+	fseek(fp, 0, SEEK_END);
+	*length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	buffer = malloc(*length + 1);
+	memset(buffer, 0, *length + 1);
+	if(fread(buffer, 1, *length, fp) != *length) { free(buffer); buffer = NULL; }
+	fclose(fp);
+	return buffer;
+}
+
+double seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(char* name, double bytes, long tokens, double elapsed)
+{
+	printf("%-12s %10ld tokens %8.3f s %9.2f MB/s\n", name, tokens, elapsed, bytes / elapsed / (1024 * 1024));
+}
+
+// lexes the buffer repeatedly with the given lexer flags and reports the 
+// lexer's throughput
+bool benchLexer(char* name, char* buffer, int length, int iterations, unsigned int flags)
+{
+	TEXTPOS position = {0,0};
+	pp_lexer lexer;
+	pp_token token;
+	long count = 0;
+	double start = seconds();
+	int i;
+
+	for(i=0; i<iterations; i++)
+	{
+		pp_lexer_Init(&lexer, buffer, position);
+		lexer.flags = flags;
+		do {
+			if(FAILED(pp_lexer_GetNextToken(&lexer, &token))) { fprintf(stderr, "Fail.\n"); return false; }
+			count++;
+		} while(token.theType != PP_TOKEN_EOF);
+	}
+
+	report(name, (double)length * iterations, count, seconds() - start);
+	return true;
+}
+
+// preprocesses the buffer into a token sink repeatedly and reports the 
+// preprocessor's throughput
+bool benchTokenSink(char* buffer, int length, int iterations)
+{
+	pp_token_sink sink;
+	pp_parser parser;
+	long count = 0;
+	double start = seconds();
+	int i;
+
+	pp_token_sink_init(&sink);
+	for(i=0; i<iterations; i++)
+	{
+		pp_parser_reset();
+		pp_parser_init(&parser, NULL, "bench", buffer, &sink.sink);
+		pp_parser_parse(&parser);
+		count += sink.count;
+		pp_token_sink_clear(&sink);
+	}
+	pp_parser_reset();
+
+	report("pp-tokens", (double)length * iterations, count, seconds() - start);
+	return count > 0;
+}
+
+// tokenizes the buffer with pp_lexer_LexAll() repeatedly, then replays the 
+// last stream repeatedly, and reports the throughput of both
+bool benchLexAll(char* buffer, int length, int iterations)
+{
+	TEXTPOS position = {0,0};
+	pp_lexer lexer;
+	pp_token_stream stream;
+	pp_token token;
+	long count = 0;
+	double start = seconds();
+	int i, j;
+
+	pp_token_stream_Init(&stream);
+	for(i=0; i<iterations; i++)
+	{
+		pp_lexer_Init(&lexer, buffer, position);
+		if(FAILED(pp_lexer_LexAll(&lexer, &stream))) { fprintf(stderr, "Fail.\n"); return false; }
+		count += stream.count;
+	}
+	report("lexall", (double)length * iterations, count, seconds() - start);
+
+	count = 0;
+	start = seconds();
+	for(i=0; i<iterations; i++)
+	{
+		for(j=0; j<stream.count; j++)
+		{
+			pp_token_stream_GetToken(&stream, j, &token);
+			count += token.theLength;
+		}
+	}
+	report("replay", (double)length * iterations, (long)stream.count * iterations, seconds() - start);
+
+	pp_token_stream_Clear(&stream);
+	return count > 0;
+}
+
+// an output sink that only counts the bytes written to it
+typedef struct {
+	pp_sink sink;
+	long count;
+} counting_sink;
+
+bool countingWrite(pp_sink* sink, const char* text, size_t length)
+{
+	((counting_sink*)sink)->count += length;
+	return true;
+}
+
+// preprocesses the buffer repeatedly and reports the preprocessor's 
+// throughput, writing the output to the token buffer or (if "stream" is true) 
+// to a sink that discards it
+bool benchParser(char* name, char* buffer, int length, int iterations, bool stream)
+{
+	counting_sink counter = {{countingWrite, NULL, NULL}, 0};
+	pp_parser parser;
+	long count = 0;
+	double start = seconds(), elapsed;
+	int i;
+
+	for(i=0; i<iterations; i++)
+	{
+		pp_parser_reset();
+		pp_parser_init(&parser, NULL, name, buffer, stream ? &counter.sink : NULL);
+		pp_parser_parse(&parser);
+		count += stream ? counter.count : strlen(tokens);
+		counter.count = 0;
+	}
+	pp_parser_reset();
+
+	elapsed = seconds() - start;
+	printf("%-12s %10ld bytes  %8.3f s %9.2f MB/s\n", name, count, elapsed, 
+	       (double)length * iterations / elapsed / (1024 * 1024));
+	return count > 0;
+}
+
+// builds a buffer of identifiers typical of OpenBOR scripts, with a keyword 
+// or directive name mixed in every so often, separated by single spaces
+char* makeIdentifiers(int count, int* length)
+{
+	static char* names[] = {"self", "getentityproperty", "changeentityproperty", 
+		"getlocalvar", "setlocalvar", "openborconstant", "health", "x", "vx", 
+		"animpos", "MAX_HEALTH", "player_index", "_tmp", "drawstring"};
+	static char* keywords[] = {"void", "int", "if", "else", "return", "while", 
+		"define", "ifndef", "continue", "float"};
+	char* buffer = malloc(count * 24 + 1);
+	char* p = buffer;
+	int i;
+
+	srand(1);
+	for(i=0; i<count; i++)
+	{
+		char* word = (i % 8 == 7) ? keywords[rand() % 10] : names[rand() % 14];
+		p += sprintf(p, "%s ", word);
+	}
+	*length = p - buffer;
+	return buffer;
+}
+
+// builds a script that defines "macros" constants and then uses them among 
+// other identifiers, one use in every 8 identifiers
+char* makeMacroScript(int macros, int identifiers, int* length)
+{
+	char* buffer;
+	char* p;
+	char* words;
+	char* word;
+	int wordsLength, i;
+
+	words = makeIdentifiers(identifiers, &wordsLength);
+	buffer = malloc(macros * 32 + identifiers * 16 + wordsLength + 1);
+	p = buffer;
+	for(i=0; i<macros; i++)
+		p += sprintf(p, "#define MACRO_%d %d\n", i, i);
+
+	// replace every 8th word with a macro
+	srand(2);
+	for(i=0, word=strtok(words, " "); word; i++, word=strtok(NULL, " "))
+	{
+		if(i % 8 == 3)
+			p += sprintf(p, "MACRO_%d ", rand() % macros);
+		else
+			p += sprintf(p, "%s ", word);
+	}
+	free(words);
+	*length = p - buffer;
+	return buffer;
+}
+
+// preprocesses scripts with from 10 to 100000 macros defined, to show how the 
+// cost of looking up identifiers scales with the number of macros
+bool benchMacros(int iterations)
+{
+	char name[32];
+	char* buffer;
+	int length, macros;
+	bool success = true;
+
+	for(macros = 10; success && macros <= 100000; macros *= 10)
+	{
+		buffer = makeMacroScript(macros, 200000, &length);
+		sprintf(name, "macros-%d", macros);
+		success = benchParser(name, buffer, length, iterations, true);
+		free(buffer);
+	}
+	return success;
+}
+
+// builds a script that calls function-like macros, some of them nested and 
+// variadic, on every line
+char* makeFunctionMacroScript(int lines, int* length)
+{
+	static char* defines = 
+		"#define MAX(a, b) ((a) > (b) ? (a) : (b))\n"
+		"#define MIN(a, b) ((a) < (b) ? (a) : (b))\n"
+		"#define CLAMP(x, lo, hi) MAX(lo, MIN(x, hi))\n"
+		"#define GETPROP(ent, prop) getentityproperty(ent, openborconstant(prop))\n"
+		"#define SETVAR(name, ...) setlocalvar(name, __VA_ARGS__)\n";
+	static char* uses[] = {
+		"hp = CLAMP(GETPROP(self, \"health\"), 0, MAX_HP);\n",
+		"SETVAR(\"target\", findtarget(self), 1);\n",
+		"x = MAX(GETPROP(self, \"x\"), MIN(left, right)) + vx * 2;\n",
+		"if(MIN(a, b) > 0) drawstring(10, 20, 0, \"ok\");\n"};
+	char* buffer = malloc(strlen(defines) + lines * 80 + 1);
+	char* p = buffer;
+	int i;
+
+	p += sprintf(p, "%s", defines);
+	for(i=0; i<lines; i++)
+		p += sprintf(p, "%s", uses[i % 4]);
+	*length = p - buffer;
+	return buffer;
+}
+
+// builds a script that uses constants defined in terms of other constants, 
+// several levels deep, on every line
+char* makeConstantMacroScript(int lines, int* length)
+{
+	static char* defines = 
+		"#define BASE_HP 100\n"
+		"#define MAX_HP (BASE_HP * 2)\n"
+		"#define BAR_WIDTH (MAX_HP / 4 + BORDER * 2)\n"
+		"#define BORDER 3\n"
+		"#define BAR_X (SCREEN_WIDTH - BAR_WIDTH - BORDER)\n"
+		"#define SCREEN_WIDTH 480\n"
+		"#define ANI_SPECIAL openborconstant(\"ANI_FOLLOW1\")\n";
+	static char* uses[] = {
+		"drawbox(BAR_X, 10, BAR_WIDTH * hp / MAX_HP, 4, 1, color, 0);\n",
+		"if(hp > MAX_HP) hp = MAX_HP;\n",
+		"changeentityproperty(self, \"animation\", ANI_SPECIAL);\n"};
+	char* buffer = malloc(strlen(defines) + lines * 80 + 1);
+	char* p = buffer;
+	int i;
+
+	p += sprintf(p, "%s", defines);
+	for(i=0; i<lines; i++)
+		p += sprintf(p, "%s", uses[i % 3]);
+	*length = p - buffer;
+	return buffer;
+}
+
+// builds a script that generates handler names and strings with '##' and '#'
+char* makePasteMacroScript(int lines, int* length)
+{
+	static char* defines = 
+		"#define HANDLER(name) void on_##name##_anim(int frame)\n"
+		"#define ANI(name) openborconstant(#name)\n"
+		"#define PROP(ent, prop) getentityproperty(ent, #prop)\n"
+		"#define VAR(name, ...) setlocalvar(#name, ## __VA_ARGS__)\n";
+	static char* uses[] = {
+		"HANDLER(idle) { changeentityproperty(self, \"animation\", ANI(ANI_IDLE)); }\n",
+		"x = PROP(self, x) + PROP(self, base);\n",
+		"VAR(target, findtarget(self)); VAR(reset);\n"};
+	char* buffer = malloc(strlen(defines) + lines * 80 + 1);
+	char* p = buffer;
+	int i;
+
+	p += sprintf(p, "%s", defines);
+	for(i=0; i<lines; i++)
+		p += sprintf(p, "%s", uses[i % 3]);
+	*length = p - buffer;
+	return buffer;
+}
+
+// preprocesses many small scripts that all include the same guarded header, 
+// several times over, the way entity scripts and the libraries they include 
+// all include a mod's shared constants
+bool benchIncludes(int iterations)
+{
+	static char* script = "#include \"pp_bench_include.h\"\n#include \"pp_bench_include.h\"\n"
+		"#include \"pp_bench_include.h\"\nvoid main() { hp = MAX_HP; }\n";
+	counting_sink counter = {{countingWrite, NULL, NULL}, 0};
+	pp_include_stats stats;
+	pp_parser parser;
+	double start, elapsed;
+	FILE* fp;
+	int i;
+
+	fp = fopen("pp_bench_include.h", "wb");
+	if(fp == NULL) return false;
+	fprintf(fp, "#ifndef PP_BENCH_INCLUDE_H\n#define PP_BENCH_INCLUDE_H\n");
+	for(i=0; i<2000; i++)
+		fprintf(fp, "#define CONSTANT_%d %d // a shared constant\n", i, i);
+	fprintf(fp, "#define MAX_HP 200\n#endif\n");
+	fclose(fp);
+
+	pp_parser_flush_includes();
+	start = seconds();
+	for(i=0; i<iterations * 100; i++)
+	{
+		pp_parser_reset();
+		pp_parser_init(&parser, NULL, "includes", script, &counter.sink);
+		pp_parser_parse(&parser);
+	}
+	pp_parser_reset();
+	elapsed = seconds() - start;
+
+	stats = pp_parser_include_stats();
+	printf("%-12s %6d hits %4d misses %6d skips %8.3f s %9.2f scripts/ms\n", "includes", stats.hits, 
+	       stats.misses, stats.skips, elapsed, iterations * 100 / elapsed / 1000);
+	pp_parser_flush_includes();
+	remove("pp_bench_include.h");
+	return counter.count > 0;
+}
+
+int main(int argc, char** argv)
+{
+	char* buffer;
+	int length, iterations = 10;
+	bool success;
+
+	if(argc > 3 || (argc > 1 && atoi(argv[1]) <= 0))
+	{
+		printf("Usage: %s [iterations [filename]]\n", argv[0]);
+		return 1;
+	}
+	if(argc > 1) iterations = atoi(argv[1]);
+
+	// synthetic benchmarks
+	buffer = makeIdentifiers(100000, &length);
+	success = benchLexer("identifiers", buffer, length, iterations, 0);
+	free(buffer);
+	success = success && benchMacros(iterations);
+	buffer = makeFunctionMacroScript(100000, &length);
+	success = success && benchParser("fn-macros", buffer, length, iterations, true);
+	free(buffer);
+	buffer = makeConstantMacroScript(100000, &length);
+	success = success && benchParser("const-macros", buffer, length, iterations, true);
+	free(buffer);
+	buffer = makePasteMacroScript(100000, &length);
+	success = success && benchParser("paste-macros", buffer, length, iterations, true);
+	free(buffer);
+	success = success && benchIncludes(iterations);
+
+	// benchmarks on a real script
+	if(success && argc > 2)
+	{
+		buffer = readFile(argv[2], &length);
+		if(buffer == NULL) { fprintf(stderr, "Couldn't read %s\n", argv[2]); return 1; }
+		success = benchLexer("lex", buffer, length, iterations, 0) &&
+		          benchLexer("coarse", buffer, length, iterations, PP_LEXER_COALESCE_WHITESPACE | PP_LEXER_COARSE) &&
+		          benchLexAll(buffer, length, iterations) &&
+		          benchParser("preprocess", buffer, length, iterations, false) &&
+		          benchParser("pp-stream", buffer, length, iterations, true) &&
+		          benchTokenSink(buffer, length, iterations);
+		free(buffer);
+	}
+
+	return !success;
+}
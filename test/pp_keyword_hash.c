@@ -0,0 +1,159 @@
+// Generates the perfect hash that pp_lexer_ClassifyIdentifier() uses to
+// recognize keywords.  If a keyword is added, renamed or removed, change the
+// list below, then build and run this program on its own:
+//
+//     gcc -o pp_keyword_hash pp_keyword_hash.c && ./pp_keyword_hash
+//
+// and replace the tables in pp_lexer.c (from MIN_KEYWORD_LENGTH down to the
+// end of keywords[]) with what it prints.  pp_scan_test checks the result.
+//
+// The hash of an identifier is its length plus the association values of its
+// first, second and last characters.  The association values are found with
+// a min-conflicts search: starting from all zeros, it keeps picking a keyword
+// that collides with another one (or hashes past the end of the table) and
+// giving one of its characters the value that leaves the fewest collisions.
+// The random choices are seeded with a constant, so the output only changes
+// when the list does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEYWORD_HASH_SIZE 64
+#define MAX_ASSOC 40
+#define MAX_STEPS 1000000
+
+static const struct { const char* name; const char* type; } keywords[] = {
+	{"include", "PP_TOKEN_INCLUDE"}, {"define", "PP_TOKEN_DEFINE"}, {"undef", "PP_TOKEN_UNDEF"},
+	{"pragma", "PP_TOKEN_PRAGMA"}, {"if", "PP_TOKEN_IF"}, {"ifdef", "PP_TOKEN_IFDEF"},
+	{"ifndef", "PP_TOKEN_IFNDEF"}, {"elif", "PP_TOKEN_ELIF"}, {"else", "PP_TOKEN_ELSE"},
+	{"endif", "PP_TOKEN_ENDIF"}, {"warning", "PP_TOKEN_WARNING"}, {"error", "PP_TOKEN_ERROR_TEXT"},
+	{"sizeof", "PP_TOKEN_SIZEOF"}, {"typedef", "PP_TOKEN_TYPEDEF"}, {"extern", "PP_TOKEN_EXTERN"},
+	{"static", "PP_TOKEN_STATIC"}, {"auto", "PP_TOKEN_AUTO"}, {"register", "PP_TOKEN_REGISTER"},
+	{"char", "PP_TOKEN_CHAR"}, {"short", "PP_TOKEN_SHORT"}, {"int", "PP_TOKEN_INT"},
+	{"long", "PP_TOKEN_LONG"}, {"signed", "PP_TOKEN_SIGNED"}, {"unsigned", "PP_TOKEN_UNSIGNED"},
+	{"float", "PP_TOKEN_FLOAT"}, {"double", "PP_TOKEN_DOUBLE"}, {"const", "PP_TOKEN_CONST"},
+	{"volatile", "PP_TOKEN_VOLATILE"}, {"void", "PP_TOKEN_VOID"}, {"struct", "PP_TOKEN_STRUCT"},
+	{"union", "PP_TOKEN_UNION"}, {"enum", "PP_TOKEN_ENUM"}, {"case", "PP_TOKEN_CASE"},
+	{"default", "PP_TOKEN_DEFAULT"}, {"switch", "PP_TOKEN_SWITCH"}, {"while", "PP_TOKEN_WHILE"},
+	{"do", "PP_TOKEN_DO"}, {"for", "PP_TOKEN_FOR"}, {"goto", "PP_TOKEN_GOTO"},
+	{"continue", "PP_TOKEN_CONTINUE"}, {"break", "PP_TOKEN_BREAK"}, {"return", "PP_TOKEN_RETURN"},
+};
+#define KEYWORD_COUNT (int)(sizeof(keywords) / sizeof(keywords[0]))
+
+static int assoc[256];
+
+int hash(int k)
+{
+	const char* name = keywords[k].name;
+	int length = strlen(name);
+	return length + assoc[(unsigned char)name[0]] + assoc[(unsigned char)name[1]] +
+	       assoc[(unsigned char)name[length - 1]];
+}
+
+// the number of keywords that share a slot with an earlier one or don't fit
+// in the table; "conflicts" is set for each of them and the ones they collide with
+int countConflicts(char* conflicts)
+{
+	int owner[KEYWORD_HASH_SIZE];
+	int k, h, cost = 0;
+
+	memset(owner, -1, sizeof(owner));
+	if(conflicts) memset(conflicts, 0, KEYWORD_COUNT);
+	for(k=0; k<KEYWORD_COUNT; k++)
+	{
+		h = hash(k);
+		if(h >= KEYWORD_HASH_SIZE || owner[h] >= 0)
+		{
+			cost++;
+			if(conflicts)
+			{
+				conflicts[k] = 1;
+				if(h < KEYWORD_HASH_SIZE) conflicts[owner[h]] = 1;
+			}
+		}
+		else owner[h] = k;
+	}
+	return cost;
+}
+
+int main(int argc, char** argv)
+{
+	char conflicts[KEYWORD_COUNT];
+	int step, k, i, c, value, cost, best, bestValue, ties, minLength = 99, maxLength = 0, column;
+	const char* name;
+	int slots[KEYWORD_HASH_SIZE];
+
+	srand(1);
+	for(step = 0; (cost = countConflicts(conflicts)) > 0; step++)
+	{
+		if(step == MAX_STEPS)
+		{
+			fprintf(stderr, "no perfect hash found; try a larger KEYWORD_HASH_SIZE or MAX_ASSOC\n");
+			return 1;
+		}
+
+		// pick a conflicting keyword, then one of the characters that hash it
+		do k = rand() % KEYWORD_COUNT; while(!conflicts[k]);
+		name = keywords[k].name;
+		i = rand() % 3;
+		c = (unsigned char)(i == 0 ? name[0] : i == 1 ? name[1] : name[strlen(name) - 1]);
+
+		// now and then take a random value, so that the search can't get stuck
+		if(rand() % 10 == 0)
+		{
+			assoc[c] = rand() % MAX_ASSOC;
+			continue;
+		}
+
+		best = cost + 1;
+		bestValue = assoc[c];
+		ties = 0;
+		for(value = 0; value < MAX_ASSOC; value++)
+		{
+			assoc[c] = value;
+			cost = countConflicts(NULL);
+			if(cost < best) { best = cost; bestValue = value; ties = 1; }
+			else if(cost == best && rand() % ++ties == 0) bestValue = value;
+		}
+		assoc[c] = bestValue;
+	}
+
+	for(k=0; k<KEYWORD_COUNT; k++)
+	{
+		int length = strlen(keywords[k].name);
+		if(length < minLength) minLength = length;
+		if(length > maxLength) maxLength = length;
+	}
+	printf("#define MIN_KEYWORD_LENGTH %d\n", minLength);
+	printf("#define MAX_KEYWORD_LENGTH %d\n", maxLength);
+	printf("#define KEYWORD_HASH_SIZE %d\n\n", KEYWORD_HASH_SIZE);
+
+	// only characters that start, follow the start of or end a keyword matter
+	printf("static const unsigned char keywordAssoc[256] = {");
+	for(c = 0, column = 0; c < 256; c++)
+	{
+		for(k=0; k<KEYWORD_COUNT; k++)
+		{
+			name = keywords[k].name;
+			if(c == name[0] || c == name[1] || c == name[strlen(name) - 1]) break;
+		}
+		if(k == KEYWORD_COUNT) continue;
+		printf(column++ % 6 ? " ['%c'] = %d," : "\n   ['%c'] = %d,", c, assoc[c]);
+	}
+	printf("\n};\n\n");
+
+	printf("typedef struct pp_keyword {\n   LPCSTR name;\n   int length;\n   PP_TOKEN_TYPE type;\n} pp_keyword;\n\n");
+	memset(slots, -1, sizeof(slots));
+	for(k=0; k<KEYWORD_COUNT; k++)
+		slots[hash(k)] = k;
+	printf("static const pp_keyword keywords[KEYWORD_HASH_SIZE] = {\n");
+	for(i=0; i<KEYWORD_HASH_SIZE; i++)
+	{
+		if(slots[i] < 0) continue;
+		k = slots[i];
+		printf("   [%d] = {\"%s\", %d, %s},\n", i, keywords[k].name, (int)strlen(keywords[k].name), keywords[k].type);
+	}
+	printf("};\n");
+	return 0;
+}
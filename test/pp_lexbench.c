@@ -0,0 +1,106 @@
+// Measures the throughput of the preprocessor lexer on its own.  It only uses 
+// the part of the lexer's interface that hasn't changed since the original 
+// strncmp-based lexer, so it can be built against an older pp_lexer.c for a 
+// side-by-side comparison.  Compile and run using bench_baseline.sh.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pp_lexer.h"
+#undef printf
+
+// returns the contents of a file in a NUL-terminated buffer, or NULL on failure
+char* readFile(char* filename, int* length)
+{
+	char* buffer;
+	FILE* fp = fopen(filename, "rb");
+	if(fp == NULL) return NULL;
+	fseek(fp, 0, SEEK_END);
+	*length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	buffer = malloc(*length + 1);
+	memset(buffer, 0, *length + 1);
+	if(fread(buffer, 1, *length, fp) != *length) { free(buffer); buffer = NULL; }
+	fclose(fp);
+	return buffer;
+}
+
+double seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// builds "count" lines of a made-up script: identifiers and keywords, 
+// operators of every length, and a comment on every fourth line
+char* makeScript(int count, int* length)
+{
+	static char* lines[] = {
+		"if (self != NULL && health <= MAX_HEALTH) { x += vx * 2; }\n",
+		"animpos = getentityproperty(self, \"animpos\") ? 1 : -1; // current frame\n",
+		"flags |= (mask << 2) ^ ~bits; count >>= 1; --i; ++j;\n",
+		"/* changeentityproperty(self, \"position\", x, z, a); */ return;\n",
+	};
+	char* buffer = malloc(count * 80 + 1);
+	char* p = buffer;
+	int i;
+
+	for(i=0; i<count; i++)
+		p += sprintf(p, "%s", lines[i % 4]);
+	*length = p - buffer;
+	return buffer;
+}
+
+// lexes the buffer repeatedly and reports the lexer's throughput
+void benchLexer(char* name, char* buffer, int length, int iterations)
+{
+	TEXTPOS position = {0,0};
+	pp_lexer lexer;
+	pp_token token;
+	long count = 0;
+	double start = seconds(), elapsed;
+	int i;
+
+	for(i=0; i<iterations; i++)
+	{
+		pp_lexer_Init(&lexer, buffer, position);
+		do {
+			if(FAILED(pp_lexer_GetNextToken(&lexer, &token))) { fprintf(stderr, "Fail.\n"); exit(1); }
+			count++;
+		} while(token.theType != PP_TOKEN_EOF);
+		pp_lexer_Clear(&lexer);
+	}
+
+	elapsed = seconds() - start;
+	printf("%-12s %10ld tokens %8.3f s %9.2f MB/s\n", name, count, elapsed, 
+	       (double)length * iterations / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char** argv)
+{
+	char* buffer;
+	int length, iterations = 10;
+
+	if(argc > 3 || (argc > 1 && atoi(argv[1]) <= 0))
+	{
+		printf("Usage: %s [iterations [filename]]\n", argv[0]);
+		return 1;
+	}
+	if(argc > 1) iterations = atoi(argv[1]);
+
+	buffer = makeScript(100000, &length);
+	benchLexer("script", buffer, length, iterations);
+	free(buffer);
+
+	if(argc > 2)
+	{
+		buffer = readFile(argv[2], &length);
+		if(buffer == NULL) { fprintf(stderr, "Couldn't read %s\n", argv[2]); return 1; }
+		benchLexer("lex", buffer, length, iterations);
+		free(buffer);
+	}
+	return 0;
+}
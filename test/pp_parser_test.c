@@ -0,0 +1,198 @@
+// Checks the output of the preprocessor on fixed inputs: macro expansion, 
+// the '#' and '##' operators, and included files.  Compile using build.sh, 
+// and run it in a directory it can write files to.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "pp_lexer.h"
+#include "pp_parser.h"
+#include "pp_sink.h"
+#undef printf
+
+typedef struct test_file {
+	char* name;
+	char* contents;
+} test_file;
+
+typedef struct test_case {
+	char* name;
+	char* source;
+	char* expected;
+	test_file files[2];    // written before the source is preprocessed
+	char* link[2];         // a hard link to make to one of them, and its name
+	int hits, misses, skips; // the expected include statistics
+} test_case;
+
+static test_case cases[] = {
+	{"recursive function-like macro",
+	 "#define f(x) f(x)+1\nf(2)\n",
+	 "\nf(2)+1\n"},
+	{"recursive object-like macros",
+	 "#define foo foo + bar\n#define bar foo\nfoo bar\n",
+	 "\n\nfoo + foo foo + bar\n"},
+	{"variadic macro",
+	 "#define LOG(fmt, ...) log(fmt, __VA_ARGS__)\nLOG(\"a\")\nLOG(\"b\", 1, (2, 3))\n",
+	 "\nlog(\"a\", )\nlog(\"b\", 1, (2, 3))\n"},
+	{"stringizing",
+	 "#define S(x) #x\nS(\"a\\\\b\\\"\" 'c')\n",
+	 "\n\"\\\"a\\\\\\\\b\\\\\\\"\\\" 'c'\"\n"},
+	{"pasting a macro name",
+	 "#define AB 42\n#define CAT(a, b) a ## b\nCAT(A, B) CAT(A, C)\n",
+	 "\n\n42 AC\n"},
+	{"redefined memoized macro",
+	 "#define A 1\n#define B A + A\nB B B\n#undef A\n#define A 2\nB\n",
+	 "\n\n1 + 1 1 + 1 1 + 1\n\n\n2 + 2\n"},
+	{"include guard",
+	 "#include \"pp_parser_test_guard.h\"\n#include \"pp_parser_test_guard.h\"\nGUARDED\n",
+	 "\n\n\nonce\n\n\n\n1\n",
+	 {{"pp_parser_test_guard.h", "#ifndef GUARD_H\n#define GUARD_H\n#define GUARDED 1\nonce\n#endif\n"}},
+	 {NULL, NULL}, 0, 1, 1},
+	{"include guard under two spellings of a path",
+	 "#include \"pp_parser_test_guard.h\"\n#include \".//pp_parser_test_guard.h\"\nGUARDED\n",
+	 "\n\n\nonce\n\n\n\n1\n",
+	 {{"pp_parser_test_guard.h", "#ifndef GUARD_H\n#define GUARD_H\n#define GUARDED 1\nonce\n#endif\n"}},
+	 {NULL, NULL}, 0, 1, 1},
+	{"#pragma once under two paths",
+	 "#include \"pp_parser_test_once.h\"\n#include \"pp_parser_test_link.h\"\nONCE\n",
+	 "\n\nonce\n\n\n2\n",
+	 {{"pp_parser_test_once.h", "#pragma once\n#define ONCE 2\nonce\n"}},
+	 {"pp_parser_test_once.h", "pp_parser_test_link.h"}, 0, 1, 1},
+};
+
+// preprocesses one test case and compares the output and include statistics 
+// with the expected ones
+bool runTest(test_case* test)
+{
+	pp_parser parser;
+	pp_include_stats stats;
+	bool success = true;
+	int i;
+
+	for(i=0; i<2 && test->files[i].name; i++)
+	{
+		FILE* fp = fopen(test->files[i].name, "wb");
+		if(fp == NULL) { printf("FAIL: %s: can't write %s\n", test->name, test->files[i].name); return false; }
+		fputs(test->files[i].contents, fp);
+		fclose(fp);
+	}
+	if(test->link[0] && link(test->link[0], test->link[1]) != 0)
+	{
+		printf("FAIL: %s: can't link %s to %s\n", test->name, test->link[1], test->link[0]);
+		success = false;
+	}
+
+	if(success)
+	{
+		pp_parser_flush_includes();
+		pp_parser_reset();
+		pp_parser_init(&parser, NULL, "test", test->source, NULL);
+		pp_parser_parse(&parser);
+		if(strcmp(tokens, test->expected) != 0)
+		{
+			printf("FAIL: %s: expected\n%s\ngot\n%s\n", test->name, test->expected, tokens);
+			success = false;
+		}
+		pp_parser_reset();
+
+		stats = pp_parser_include_stats();
+		if(stats.hits != test->hits || stats.misses != test->misses || stats.skips != test->skips)
+		{
+			printf("FAIL: %s: expected %d hits, %d misses and %d skips, got %d, %d and %d\n", test->name,
+			       test->hits, test->misses, test->skips, stats.hits, stats.misses, stats.skips);
+			success = false;
+		}
+		pp_parser_flush_includes();
+	}
+
+	for(i=0; i<2 && test->files[i].name; i++)
+		remove(test->files[i].name);
+	if(test->link[1]) remove(test->link[1]);
+	return success;
+}
+
+// preprocesses a script into a token sink and reads the tokens back, then 
+// checks that reading stops at a record that's cut short or names a file 
+// the sink doesn't have
+bool checkTokenSink()
+{
+	static struct { PP_TOKEN_TYPE type; char* text; int line; } expected[] = {
+		{PP_TOKEN_INT, "int", 1}, {PP_TOKEN_IDENTIFIER, "a", 1}, {PP_TOKEN_ASSIGN, "=", 1},
+		{PP_TOKEN_INTCONSTANT, "300", 1}, {PP_TOKEN_SEMICOLON, ";", 2}
+	};
+	pp_token_sink sink;
+	pp_sink_token token;
+	pp_parser parser;
+	size_t position = 0, length, fullLength;
+	int count = 0, filenameCount;
+	bool success = true;
+
+	pp_token_sink_init(&sink);
+	pp_parser_reset();
+	pp_parser_init(&parser, NULL, "test", "#define N 300\nint a = N\n;\n", &sink.sink);
+	pp_parser_parse(&parser);
+	pp_parser_reset();
+
+	while(success && pp_token_sink_read(&sink, &position, &token))
+	{
+		if(count >= sizeof(expected)/sizeof(expected[0]) || token.type != expected[count].type ||
+		   token.length != strlen(expected[count].text) || strncmp(token.text, expected[count].text, token.length) != 0 ||
+		   token.line != expected[count].line || strcmp(token.filename, "test") != 0)
+		{
+			printf("FAIL: token sink: token %d is '%.*s' from %s:%d\n", count, token.length, token.text,
+			       token.filename, token.line);
+			success = false;
+		}
+		count++;
+	}
+	if(success && count != sizeof(expected)/sizeof(expected[0]))
+	{
+		printf("FAIL: token sink: read %d tokens\n", count);
+		success = false;
+	}
+
+	// every token read from a truncated sink has to end inside it
+	fullLength = sink.records.length;
+	for(length = 0; success && length < fullLength; length++)
+	{
+		sink.records.length = length;
+		for(position = 0; pp_token_sink_read(&sink, &position, &token); )
+		{
+			if(position > length)
+			{
+				printf("FAIL: token sink: read past the end of %d bytes\n", (int)length);
+				success = false;
+				break;
+			}
+		}
+	}
+	sink.records.length = fullLength;
+
+	filenameCount = sink.filenameCount;
+	sink.filenameCount = 0;
+	position = 0;
+	if(success && pp_token_sink_read(&sink, &position, &token))
+	{
+		printf("FAIL: token sink: read a token from an unknown file\n");
+		success = false;
+	}
+	sink.filenameCount = filenameCount;
+
+	pp_token_sink_clear(&sink);
+	return success;
+}
+
+int main(int argc, char** argv)
+{
+	bool success = true;
+	int i;
+
+	for(i=0; i<sizeof(cases)/sizeof(cases[0]); i++)
+		success = runTest(&cases[i]) && success;
+	success = checkTokenSink() && success;
+
+	printf("%s\n", success ? "OK" : "FAILED");
+	return !success;
+}
@@ -0,0 +1,328 @@
+// Checks that the vectorized scanners used by the preprocessor lexer agree
+// with the scalar versions.  Compile using build.sh.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "pp_lexer.h"
+#undef printf
+
+#define BUFFER_SIZE 4096
+
+static PP_SCAN_SET sets[] = {PP_SCAN_LINE_COMMENT, PP_SCAN_STAR_COMMENT, PP_SCAN_STRING};
+
+// fills a buffer with random text where roughly one character in "density"
+// is one the scanners might stop at
+void fillBuffer(char* buffer, int length, int density)
+{
+	static const char interesting[] = "*\n\r\f\"\\/";
+	int i;
+	for(i=0; i<length; i++)
+	{
+		if(rand() % density == 0)
+			buffer[i] = interesting[rand() % (sizeof(interesting) - 1)];
+		else
+			buffer[i] = 'a' + rand() % 26;
+	}
+	buffer[length] = '\0';
+}
+
+// scans from every offset in the buffer with the scalar scanner and with 
+// every vector scanner the CPU supports, to the end of the buffer and to a 
+// random point before it
+bool compareScanners(char* buffer, int length)
+{
+	int i, s, end, level;
+	for(s=0; s<sizeof(sets)/sizeof(sets[0]); s++)
+	{
+		for(i=0; i<=length; i++)
+		{
+			for(end = length; end >= i; end = end > i ? i + rand() % (end - i) : i - 1)
+			{
+				LPCSTR expected = pp_lexer_ScanScalar(buffer + i, buffer + end, sets[s]);
+				for(level = PP_SCAN_LEVEL_SSE2; level <= pp_lexer_ScanLevel(); level++)
+				{
+					LPCSTR actual = pp_lexer_ScanAt(level, buffer + i, buffer + end, sets[s]);
+					if(actual != expected)
+					{
+						printf("FAIL: level %d, set %d from offset %d to %d of %d: expected %d, got %d\n",
+						       level, sets[s], i, end, length, (int)(expected - buffer), (int)(actual - buffer));
+						return false;
+					}
+				}
+				if(end == length && length - i > 64) break;
+			}
+		}
+	}
+	return true;
+}
+
+static struct { char* name; PP_TOKEN_TYPE type; } keywords[] = {
+	{"include", PP_TOKEN_INCLUDE}, {"define", PP_TOKEN_DEFINE}, {"undef", PP_TOKEN_UNDEF},
+	{"pragma", PP_TOKEN_PRAGMA}, {"if", PP_TOKEN_IF}, {"ifdef", PP_TOKEN_IFDEF},
+	{"ifndef", PP_TOKEN_IFNDEF}, {"elif", PP_TOKEN_ELIF}, {"else", PP_TOKEN_ELSE},
+	{"endif", PP_TOKEN_ENDIF}, {"warning", PP_TOKEN_WARNING}, {"error", PP_TOKEN_ERROR_TEXT},
+	{"sizeof", PP_TOKEN_SIZEOF}, {"typedef", PP_TOKEN_TYPEDEF}, {"extern", PP_TOKEN_EXTERN},
+	{"static", PP_TOKEN_STATIC}, {"auto", PP_TOKEN_AUTO}, {"register", PP_TOKEN_REGISTER},
+	{"char", PP_TOKEN_CHAR}, {"short", PP_TOKEN_SHORT}, {"int", PP_TOKEN_INT},
+	{"long", PP_TOKEN_LONG}, {"signed", PP_TOKEN_SIGNED}, {"unsigned", PP_TOKEN_UNSIGNED},
+	{"float", PP_TOKEN_FLOAT}, {"double", PP_TOKEN_DOUBLE}, {"const", PP_TOKEN_CONST},
+	{"volatile", PP_TOKEN_VOLATILE}, {"void", PP_TOKEN_VOID}, {"struct", PP_TOKEN_STRUCT},
+	{"union", PP_TOKEN_UNION}, {"enum", PP_TOKEN_ENUM}, {"case", PP_TOKEN_CASE},
+	{"default", PP_TOKEN_DEFAULT}, {"switch", PP_TOKEN_SWITCH}, {"while", PP_TOKEN_WHILE},
+	{"do", PP_TOKEN_DO}, {"for", PP_TOKEN_FOR}, {"goto", PP_TOKEN_GOTO},
+	{"continue", PP_TOKEN_CONTINUE}, {"break", PP_TOKEN_BREAK}, {"return", PP_TOKEN_RETURN},
+};
+
+// classifies an identifier with pp_lexer_ClassifyIdentifier() and by looking 
+// it up in the table above, and prints a message if they disagree
+bool checkIdentifier(const char* identifier, int length)
+{
+	PP_TOKEN_TYPE expected = PP_TOKEN_IDENTIFIER, actual;
+	int k;
+
+	for(k=0; k<sizeof(keywords)/sizeof(keywords[0]); k++)
+		if(strlen(keywords[k].name) == length && strncmp(keywords[k].name, identifier, length) == 0)
+			expected = keywords[k].type;
+	actual = pp_lexer_ClassifyIdentifier(identifier, length);
+	if(actual != expected)
+		printf("FAIL: '%.*s' is classified as %d instead of %d\n", length, identifier, actual, expected);
+	return actual == expected;
+}
+
+// checks every keyword, every identifier that has a keyword's length and 
+// first and last characters but differs from it in one other character, and
+// every keyword minus its last character
+bool checkKeywords()
+{
+	static const char characters[] = "abcdefghijklmnopqrstuvwxyz_0123456789";
+	char identifier[16];
+	int k, i, c, length;
+
+	for(k=0; k<sizeof(keywords)/sizeof(keywords[0]); k++)
+	{
+		// identifiers are classified in place, so they needn't be NUL-terminated
+		length = strlen(keywords[k].name);
+		sprintf(identifier, "%sx", keywords[k].name);
+		if(!checkIdentifier(identifier, length) || !checkIdentifier(identifier, length - 1))
+			return false;
+		for(i=1; i<length-1; i++)
+		{
+			for(c=0; c<sizeof(characters)-1; c++)
+			{
+				identifier[i] = characters[c];
+				if(!checkIdentifier(identifier, length)) return false;
+			}
+			identifier[i] = keywords[k].name[i];
+		}
+	}
+	return true;
+}
+
+// checks the tokens of runs of spaces and tabs, one character at a time and
+// with PP_LEXER_COALESCE_WHITESPACE, and the columns of what follows them
+bool checkWhitespace()
+{
+	static char source[] = "a \t \tb\n\t c";
+	typedef struct { char* text; int row, col; } expectedToken;
+	static expectedToken separate[] = {
+		{"a", 0, 0}, {" ", 0, 1}, {"\t", 0, 2}, {" ", 0, 6}, {"\t", 0, 7}, {"b", 0, 11},
+		{"\n", 0, 12}, {"\t", 1, 0}, {" ", 1, 4}, {"c", 1, 5}, {NULL}
+	};
+	static expectedToken coalesced[] = {
+		{"a", 0, 0}, {" \t \t", 0, 1}, {"b", 0, 11}, {"\n", 0, 12}, {"\t ", 1, 0}, {"c", 1, 5}, {NULL}
+	};
+	expectedToken* expected;
+	TEXTPOS start = {0,0}, position;
+	pp_lexer lexer;
+	pp_token token;
+	int flags, i;
+	bool success = true;
+
+	for(flags = 0; success && flags <= PP_LEXER_COALESCE_WHITESPACE; flags += PP_LEXER_COALESCE_WHITESPACE)
+	{
+		expected = flags ? coalesced : separate;
+		pp_lexer_Init(&lexer, source, start);
+		lexer.flags = flags;
+		for(i=0; success; i++)
+		{
+			pp_lexer_GetNextToken(&lexer, &token);
+			if(token.theType == PP_TOKEN_EOF && expected[i].text == NULL) break;
+			pp_lexer_GetPosition(&lexer, token.charOffset, &position);
+			if(expected[i].text == NULL || !pp_token_Equals(&token, expected[i].text) ||
+			   position.row != expected[i].row || position.col != expected[i].col)
+			{
+				printf("FAIL: with flags %d, token %d is '%.*s' (length %d) at %d:%d\n", flags, i,
+				       token.theLength, token.theSource, token.theLength, position.row, position.col);
+				success = false;
+			}
+		}
+		pp_lexer_Clear(&lexer);
+	}
+	return success;
+}
+
+// lexes text that ends right before an inaccessible page, so that reading 
+// past its end crashes, and checks that the tokens are the same as those of 
+// a NUL-terminated copy
+bool checkBounds()
+{
+	static char* endings[] = {
+		"a", "12", "0x", "1.5e", "'", "'\\", "'a", "\"abc", "\"a\\", "/", "/*", "/* *", 
+		"// x", "\r", "+", "<<", "#", " \t", "x\n", "*/"
+	};
+	long pageSize = sysconf(_SC_PAGESIZE);
+	char* pages = mmap(NULL, pageSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	TEXTPOS position = {0,0};
+	int i, coarse;
+	
+	if(pages == MAP_FAILED || mprotect(pages + pageSize, pageSize, PROT_NONE) != 0)
+	{
+		printf("FAIL: can't set up a guard page\n");
+		return false;
+	}
+	for(coarse = 0; coarse <= PP_LEXER_COARSE; coarse += PP_LEXER_COARSE)
+	{
+		for(i=0; i<sizeof(endings)/sizeof(endings[0]); i++)
+		{
+			int length = strlen(endings[i]);
+			char* text = pages + pageSize - length;
+			pp_lexer bounded, terminated;
+			pp_token expected, actual;
+			
+			memcpy(text, endings[i], length);
+			pp_lexer_InitLength(&bounded, text, length, position);
+			pp_lexer_Init(&terminated, endings[i], position);
+			bounded.flags = terminated.flags = coarse;
+			do {
+				pp_lexer_GetNextToken(&terminated, &expected);
+				pp_lexer_GetNextToken(&bounded, &actual);
+				if(actual.theType != expected.theType || actual.theLength != expected.theLength)
+				{
+					printf("FAIL: lexing '%s' up to its end gives a different token\n", endings[i]);
+					munmap(pages, pageSize * 2);
+					return false;
+				}
+			} while(expected.theType != PP_TOKEN_EOF);
+		}
+	}
+	munmap(pages, pageSize * 2);
+	return true;
+}
+
+// lexes the same text token by token and with pp_lexer_LexAll(), with each
+// combination of flags, and checks that replaying the stream gives the same
+// tokens
+bool checkTokenStream()
+{
+	static char source[] = "#define A(x) x\r\nint a = 0x1f;\r// c\n/* d\r\n */\f\"e\\\"\" 'f'  \t\tA(1.5e3)\n";
+	TEXTPOS position = {0,0};
+	pp_lexer lexer, streamLexer;
+	pp_token_stream stream;
+	pp_token expected, actual;
+	int flags, i;
+	bool success = true;
+
+	pp_token_stream_Init(&stream);
+	for(flags = 0; success && flags <= (PP_LEXER_COALESCE_WHITESPACE | PP_LEXER_COARSE); flags++)
+	{
+		pp_lexer_Init(&lexer, source, position);
+		pp_lexer_Init(&streamLexer, source, position);
+		lexer.flags = streamLexer.flags = flags;
+		if(FAILED(pp_lexer_LexAll(&streamLexer, &stream)))
+		{
+			printf("FAIL: pp_lexer_LexAll failed with flags %d\n", flags);
+			success = false;
+		}
+		for(i=0; success && i<stream.count; i++)
+		{
+			pp_lexer_GetNextToken(&lexer, &expected);
+			pp_token_stream_GetToken(&stream, i, &actual);
+			if(actual.theType != expected.theType || actual.charOffset != expected.charOffset ||
+			   actual.theLength != expected.theLength ||
+			   memcmp(actual.theSource, expected.theSource, expected.theLength) != 0 ||
+			   stream.offsets[i] != lexer.tokOffset || stream.lengths[i] != lexer.offset - lexer.tokOffset)
+			{
+				printf("FAIL: with flags %d, token %d of the stream is '%.*s' at %u instead of '%.*s' at %u\n",
+				       flags, i, actual.theLength, actual.theSource, (unsigned)actual.charOffset,
+				       expected.theLength, expected.theSource, (unsigned)expected.charOffset);
+				success = false;
+			}
+		}
+		if(success && (stream.count == 0 || stream.types[stream.count - 1] != PP_TOKEN_EOF))
+		{
+			printf("FAIL: with flags %d, the stream doesn't end with PP_TOKEN_EOF\n", flags);
+			success = false;
+		}
+		pp_lexer_Clear(&lexer);
+		pp_lexer_Clear(&streamLexer);
+	}
+	pp_token_stream_Clear(&stream);
+	return success;
+}
+
+// checks the rows and columns of the tokens after comments and strings
+bool checkPositions()
+{
+	static char source[] = "/* one\n two\n\n */ a // three\n\"four \\\" five\" b\n/* * / **/c";
+	static struct { char* text; int row, col; } expected[] = {
+		{"a", 3, 4}, {"\n", 3, 14}, {"\"four \\\" five\"", 4, 0}, {"b", 4, 15}, {"\n", 4, 16}, {"c", 5, 10}
+	};
+	TEXTPOS position = {0,0};
+	pp_lexer lexer;
+	pp_token token;
+	int i = 0;
+	bool success = true;
+
+	pp_lexer_Init(&lexer, source, position);
+	do {
+		pp_lexer_GetNextToken(&lexer, &token);
+		if(token.theType == PP_TOKEN_WHITESPACE || token.theType == PP_TOKEN_EOF) continue;
+		pp_lexer_GetPosition(&lexer, token.charOffset, &position);
+		if(i >= sizeof(expected)/sizeof(expected[0]) || !pp_token_Equals(&token, expected[i].text) ||
+		   position.row != expected[i].row || position.col != expected[i].col)
+		{
+			printf("FAIL: token %d is '%.*s' at %d:%d\n", i, token.theLength, token.theSource,
+			       position.row, position.col);
+			success = false;
+			break;
+		}
+		i++;
+	} while(token.theType != PP_TOKEN_EOF);
+
+	pp_lexer_Clear(&lexer);
+	return success;
+}
+
+int main(int argc, char** argv)
+{
+	char* buffer = malloc(BUFFER_SIZE + 1);
+	int length, density, trial;
+	bool success = true;
+
+	printf("fastest scanner: %s\n", (char*[]){"scalar", "SSE2", "AVX2"}[pp_lexer_ScanLevel()]);
+	srand(1);
+	for(density = 1; success && density <= 256; density *= 2)
+	{
+		for(trial = 0; success && trial < 20; trial++)
+		{
+			length = rand() % BUFFER_SIZE;
+			fillBuffer(buffer, length, density);
+			success = compareScanners(buffer, length);
+		}
+	}
+
+	if(success) success = checkKeywords();
+	if(success) success = checkTokenStream();
+	if(success) success = checkPositions();
+	if(success) success = checkWhitespace();
+	if(success) success = checkBounds();
+	free(buffer);
+
+	printf("%s\n", success ? "OK" : "FAILED");
+	return !success;
+}
+
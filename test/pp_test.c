@@ -34,7 +34,7 @@ bool lexFile(char* filename)
 	
 	do {
 		if(FAILED(pp_lexer_GetNextToken(&lexer, &token))) { fprintf(stderr, "Fail.\n"); return false; }
-		printf("%s", token.theSource);
+		printf("%.*s", token.theLength, token.theSource);
 	} while(token.theType != PP_TOKEN_EOF);
 	
 	pp_lexer_Clear(&lexer);
@@ -67,7 +67,7 @@ bool parseFile(char* filename)
 	if(!success) return false;
 	
 	pp_parser_reset();
-	pp_parser_init(&parser, NULL, filename, buffer);
+	pp_parser_init(&parser, NULL, filename, buffer, NULL);
 	pp_parser_parse(&parser);
 	
 	// Don't forget to free the buffer!